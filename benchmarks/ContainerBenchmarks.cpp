@@ -0,0 +1,121 @@
+#include <List.h>
+#include <UnorderedMap.h>
+#include <Vector.h>
+#include <forward_list>
+#include <unordered_map>
+#include <vector>
+
+#include "Helper.h"
+
+static void BM_VectorPushBack(benchmark::State &state) {
+  AllocationCounter counter;
+  for (auto _ : state) {
+    Vector<size_t> vector;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      vector.push_back(i);
+    }
+    benchmark::DoNotOptimize(vector.back());
+  }
+
+  counter.Report(state);
+  state.SetComplexityN(state.range(0));
+}
+
+static void BM_StdVectorPushBack(benchmark::State &state) {
+  AllocationCounter counter;
+  for (auto _ : state) {
+    std::vector<size_t> vector;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      vector.push_back(i);
+    }
+    benchmark::DoNotOptimize(vector.back());
+  }
+
+  counter.Report(state);
+  state.SetComplexityN(state.range(0));
+}
+
+static void BM_ListPushFront(benchmark::State &state) {
+  AllocationCounter counter;
+  for (auto _ : state) {
+    List<size_t> list;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      list.PushFront(i);
+    }
+    benchmark::DoNotOptimize(list.begin()->GetItem());
+  }
+
+  counter.Report(state);
+  state.SetComplexityN(state.range(0));
+}
+
+static void BM_StdListPushFront(benchmark::State &state) {
+  AllocationCounter counter;
+  for (auto _ : state) {
+    std::forward_list<size_t> list;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      list.push_front(i);
+    }
+    benchmark::DoNotOptimize(list.front());
+  }
+
+  counter.Report(state);
+  state.SetComplexityN(state.range(0));
+}
+
+static void BM_MapInsertFind(benchmark::State &state) {
+  AllocationCounter counter;
+  for (auto _ : state) {
+    UnorderedMap<size_t, size_t> map;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      map.insert({i, i});
+    }
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      benchmark::DoNotOptimize(map.find(i)->second);
+    }
+  }
+
+  counter.Report(state);
+  state.SetComplexityN(state.range(0));
+}
+
+static void BM_StdMapInsertFind(benchmark::State &state) {
+  AllocationCounter counter;
+  for (auto _ : state) {
+    std::unordered_map<size_t, size_t> map;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      map.insert({i, i});
+    }
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      benchmark::DoNotOptimize(map.find(i)->second);
+    }
+  }
+
+  counter.Report(state);
+  state.SetComplexityN(state.range(0));
+}
+
+BENCHMARK(BM_VectorPushBack)
+    ->RangeMultiplier(8)
+    ->Range(8, 1 << 18)
+    ->Complexity();
+BENCHMARK(BM_StdVectorPushBack)
+    ->RangeMultiplier(8)
+    ->Range(8, 1 << 18)
+    ->Complexity();
+BENCHMARK(BM_ListPushFront)
+    ->RangeMultiplier(8)
+    ->Range(8, 1 << 18)
+    ->Complexity();
+BENCHMARK(BM_StdListPushFront)
+    ->RangeMultiplier(8)
+    ->Range(8, 1 << 18)
+    ->Complexity();
+BENCHMARK(BM_MapInsertFind)
+    ->RangeMultiplier(8)
+    ->Range(8, 1 << 18)
+    ->Complexity();
+BENCHMARK(BM_StdMapInsertFind)
+    ->RangeMultiplier(8)
+    ->Range(8, 1 << 18)
+    ->Complexity();
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <benchmark/benchmark.h>
+#include <Differentiator.h>
+#include <Stats.h>
+
+// Reads the counters kept by the counting operator new, so every allocation
+// of the benchmark thread is seen, custom containers included.
+class AllocationCounter {
+ public:
+  AllocationCounter()
+      : allocations_(Stats::Allocations()), bytes_(Stats::AllocatedBytes()) {}
+
+  // Reports the allocations made since construction, averaged per iteration.
+  void Report(benchmark::State &state) const {
+    state.counters["allocs"] =
+        benchmark::Counter(Stats::Allocations() - allocations_,
+                           benchmark::Counter::kAvgIterations);
+    state.counters["bytes"] =
+        benchmark::Counter(Stats::AllocatedBytes() - bytes_,
+                           benchmark::Counter::kAvgIterations);
+  }
+
+  // Allocations between Pause and Resume are not reported.
+  void Pause() {
+    paused_allocations_ = Stats::Allocations();
+    paused_bytes_ = Stats::AllocatedBytes();
+  }
+
+  void Resume() {
+    allocations_ += Stats::Allocations() - paused_allocations_;
+    bytes_ += Stats::AllocatedBytes() - paused_bytes_;
+  }
+
+ private:
+  size_t allocations_;
+  size_t bytes_;
+  size_t paused_allocations_ = 0;
+  size_t paused_bytes_ = 0;
+};
+
+enum class Shape { kDeepChain, kWideSum, kNestedPowers };
+
+// sin(x+cos(1*sin(x+...y...))) with n nested functions.
+inline String DeepChain(size_t n) {
+  String expr;
+  for (size_t i = 0; i < n; ++i) {
+    expr += i % 2 == 0 ? "sin(x+" : "cos(1*";
+  }
+  expr += "y";
+  expr += String(n, ')');
+  return expr;
+}
+
+// n terms mixing variables, constants and neutral elements.
+inline String WideSum(size_t n) {
+  static const char *kTerms[] = {"x*y", "1*z", "2*3*x", "y+0", "x^2"};
+  String expr = "x";
+  for (size_t i = 1; i < n; ++i) {
+    expr += "+";
+    expr += kTerms[i % 5];
+  }
+  return expr;
+}
+
+// (((x^2)^y)^1)... with n powers.
+inline String NestedPowers(size_t n) {
+  static const char *kPowers[] = {"2", "y", "1"};
+  String expr(n, '(');
+  expr += "x";
+  for (size_t i = 0; i < n; ++i) {
+    expr += "^";
+    expr += kPowers[i % 3];
+    expr += ")";
+  }
+  return expr;
+}
+
+// x-y+x-y... with n operations, a left-deep tree of depth n.
+inline String LongChain(size_t n) {
+  String expr = "x";
+  for (size_t i = 0; i < n; ++i) {
+    expr += i % 2 == 0 ? "-y" : "+x";
+  }
+  return expr;
+}
+
+// n copies of an expression from the tests joined into one sum.
+inline String ScaledSum(size_t n) {
+  static const char *kTerm =
+      "(y*z*x)*(1+2+3)+x*x*x*x+(y+x)*(z-x/(z+x))*x";
+  String expr = kTerm;
+  for (size_t i = 1; i < n; ++i) {
+    expr += "+";
+    expr += kTerm;
+  }
+  return expr;
+}
+
+inline String Generate(Shape shape, size_t n) {
+  switch (shape) {
+    case Shape::kDeepChain:
+      return DeepChain(n);
+    case Shape::kWideSum:
+      return WideSum(n);
+    case Shape::kNestedPowers:
+      return NestedPowers(n);
+  }
+  return String();
+}
+
+inline size_t CountNodes(const Parser::ParseTree &tree) {
+  size_t nodes = 0;
+  for (auto &&node = tree.begin(); node != tree.end(); ++node) {
+    ++nodes;
+  }
+  return nodes;
+}
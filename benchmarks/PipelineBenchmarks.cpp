@@ -0,0 +1,406 @@
+#include <DerivativeCache.h>
+#include <Differentiator.h>
+#include <ForkJoinPool.h>
+#include <IncrementalFormula.h>
+#include <JitFormula.h>
+#include <LazyDerivative.h>
+
+#include "Helper.h"
+
+static const UnorderedMap<String, String> kPoint = {
+    {"x", "1.5"}, {"y", "0.5"}, {"z", "2"}};
+
+template <Shape shape>
+static void BM_Parse(benchmark::State &state) {
+  auto expr = Generate(shape, state.range(0));
+  Parser parser;
+  size_t nodes = 0;
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    auto tree = parser.Parse(expr);
+    nodes = CountNodes(tree.value());
+    benchmark::DoNotOptimize(tree);
+  }
+
+  counter.Report(state);
+  state.counters["nodes"] = nodes;
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_Differentiate(benchmark::State &state) {
+  auto expr = Generate(shape, state.range(0));
+  Differentiator differentiator;
+  size_t nodes = 0;
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    auto derivative = differentiator.Differentiate(expr, "x");
+    nodes = CountNodes(derivative.GetTree());
+    benchmark::DoNotOptimize(derivative);
+  }
+
+  counter.Report(state);
+  state.counters["nodes"] = nodes;
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_CachedDifferentiate(benchmark::State &state) {
+  auto expr = Generate(shape, state.range(0));
+  DerivativeCache cache(1 << 30);
+  cache.Differentiate(expr, "x");
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(cache.Differentiate(expr, "x"));
+  }
+
+  counter.Report(state);
+  state.counters["hits"] = cache.Hits();
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_Optimize(benchmark::State &state) {
+  auto expr = Generate(shape, state.range(0));
+  size_t nodes = 0;
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    state.PauseTiming();
+    counter.Pause();
+    Formula formula(expr);
+    counter.Resume();
+    state.ResumeTiming();
+
+    formula.Optimize();
+    nodes = CountNodes(formula.GetTree());
+  }
+
+  counter.Report(state);
+  state.counters["nodes"] = nodes;
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_Simplify(benchmark::State &state) {
+  auto derivative =
+      Differentiator().Differentiate(Generate(shape, state.range(0)), "x");
+
+  for (auto _ : state) {
+    auto simplified = derivative;
+    simplified.Simplify();
+    state.counters["cost"] = simplified.Cost();
+  }
+
+  state.counters["cost_before"] = derivative.Cost();
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_At(benchmark::State &state) {
+  auto derivative =
+      Differentiator().Differentiate(Generate(shape, state.range(0)), "x");
+  size_t nodes = 0;
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    auto value = derivative.At(kPoint);
+    nodes = CountNodes(value.GetTree());
+    benchmark::DoNotOptimize(value);
+  }
+
+  counter.Report(state);
+  state.counters["nodes"] = nodes;
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_JitCompile(benchmark::State &state) {
+  auto derivative =
+      Differentiator().Differentiate(Generate(shape, state.range(0)), "x");
+
+  for (auto _ : state) {
+    JitFormula jit(derivative);
+    benchmark::DoNotOptimize(jit.GetFunction());
+  }
+
+  state.counters["nodes"] = CountNodes(derivative.GetTree());
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_JitEvaluate(benchmark::State &state) {
+  auto derivative =
+      Differentiator().Differentiate(Generate(shape, state.range(0)), "x");
+  JitFormula jit(derivative);
+  Vector<double> values(jit.ValuesNumber());
+  for (auto &value : values) {
+    value = 0.5;
+  }
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(jit.Evaluate(values.begin()));
+  }
+
+  state.counters["nodes"] = CountNodes(derivative.GetTree());
+  state.SetComplexityN(state.range(0));
+}
+
+// One variable changes per step, so only the nodes above its leaves are
+// recomputed.
+template <Shape shape>
+static void BM_IncrementalEvaluate(benchmark::State &state) {
+  Formula formula(Generate(shape, state.range(0)));
+  Vector<long double> values(formula.ValuesNumber());
+  for (auto &value : values) {
+    value = 0.5;
+  }
+  IncrementalFormula incremental(formula, values);
+  long double y = 0;
+
+  for (auto _ : state) {
+    y += 0.125;
+    incremental.Set("y", y);
+    benchmark::DoNotOptimize(incremental.Value());
+  }
+
+  state.counters["nodes"] = incremental.Size();
+  state.counters["recomputed"] = benchmark::Counter(
+      incremental.Recomputed(), benchmark::Counter::kAvgIterations);
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_Evaluate(benchmark::State &state) {
+  Formula formula(Generate(shape, state.range(0)));
+  Vector<long double> values(formula.ValuesNumber());
+  for (auto &value : values) {
+    value = 0.5;
+  }
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(formula.Evaluate(values));
+  }
+
+  state.counters["nodes"] = CountNodes(formula.GetTree());
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_FlatEvaluate(benchmark::State &state) {
+  Formula formula(Generate(shape, state.range(0)));
+  formula.Flatten();
+  Vector<long double> values(formula.ValuesNumber());
+  for (auto &value : values) {
+    value = 0.5;
+  }
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(formula.Evaluate(values));
+  }
+
+  state.counters["nodes"] = CountNodes(formula.GetTree());
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_ToString(benchmark::State &state) {
+  auto derivative =
+      Differentiator().Differentiate(Generate(shape, state.range(0)), "x");
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(derivative.ToString());
+  }
+
+  counter.Report(state);
+  state.counters["nodes"] = CountNodes(derivative.GetTree());
+  state.SetComplexityN(state.range(0));
+}
+
+template <Shape shape>
+static void BM_LaTeX(benchmark::State &state) {
+  auto derivative =
+      Differentiator().Differentiate(Generate(shape, state.range(0)), "x");
+
+  AllocationCounter counter;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(derivative.GetLaTeX());
+  }
+
+  counter.Report(state);
+  state.counters["nodes"] = CountNodes(derivative.GetTree());
+  state.SetComplexityN(state.range(0));
+}
+
+// Parsing and releasing a very deep tree; both used to recurse per level.
+static void BM_DeepParse(benchmark::State &state) {
+  auto expr = LongChain(state.range(0));
+  Parser parser;
+
+  for (auto _ : state) {
+    auto tree = parser.Parse(expr);
+    benchmark::DoNotOptimize(tree);
+  }
+
+  state.SetComplexityN(state.range(0));
+}
+
+// At copies the tree with CreateLike and walks it with fresh iterators.
+static void BM_DeepAt(benchmark::State &state) {
+  Formula formula(LongChain(state.range(0)));
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(formula.At(kPoint));
+  }
+
+  state.SetComplexityN(state.range(0));
+}
+
+// Evaluation latency of a long sum as parsed (range(1) == 0) and rebalanced.
+static void BM_RebalancedEvaluate(benchmark::State &state) {
+  Formula formula(ScaledSum(state.range(0)));
+  if (state.range(1) != 0) {
+    formula.Rebalance();
+  }
+  Vector<long double> values(formula.ValuesNumber());
+  for (auto &value : values) {
+    value = 0.5;
+  }
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(formula.Evaluate(values));
+  }
+
+  state.counters["depth"] = formula.Depth();
+  state.SetComplexityN(state.range(0));
+}
+
+static void BM_RebalancedJitEvaluate(benchmark::State &state) {
+  Formula formula(ScaledSum(state.range(0)));
+  if (state.range(1) != 0) {
+    formula.Rebalance();
+  }
+  JitFormula jit(formula);
+  Vector<double> values(std::max<size_t>(jit.ValuesNumber(), 1));
+  for (auto &value : values) {
+    value = 0.5;
+  }
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(jit.Evaluate(values.begin()));
+  }
+
+  state.counters["depth"] = formula.Depth();
+  state.SetComplexityN(state.range(0));
+}
+
+// Differentiation and optimization of a long sum on range(1) threads; 0 is
+// the sequential differentiator.
+static void BM_ParallelDifferentiate(benchmark::State &state) {
+  auto expr = ScaledSum(state.range(0));
+  ForkJoinPool pool(std::max<size_t>(state.range(1), 1));
+  auto differentiator =
+      state.range(1) == 0 ? Differentiator() : Differentiator(&pool);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(differentiator.Differentiate(expr, "x"));
+  }
+
+  state.SetComplexityN(state.range(0));
+}
+
+// A lazy derivative of a long sum whose root and first term are looked at
+// (range(1) == 0) or which is evaluated once (range(1) == 1).
+static void BM_LazyDerivative(benchmark::State &state) {
+  Formula formula(ScaledSum(state.range(0)));
+  formula.Flatten();
+  UnorderedMap<String, long double> point = {{"x", 1.5}, {"y", 0.5}, {"z", 2}};
+
+  size_t materialized = 0;
+  for (auto _ : state) {
+    LazyDerivative derivative(formula, "x");
+    if (state.range(1) == 0) {
+      size_t term = derivative.GetChild(LazyDerivative::kRoot, 0);
+      benchmark::DoNotOptimize(derivative.GetToken(term));
+    } else {
+      benchmark::DoNotOptimize(derivative.Evaluate(point));
+    }
+    materialized = derivative.MaterializedNumber();
+  }
+
+  state.counters["materialized"] = materialized;
+  state.SetComplexityN(state.range(0));
+}
+
+// Printing a flattened long sum, whose root has one child per term.
+static void BM_WidePrint(benchmark::State &state) {
+  Formula formula(ScaledSum(state.range(0)));
+  formula.Flatten();
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(formula.ToString());
+  }
+
+  state.SetComplexityN(state.range(0));
+}
+
+#define PIPELINE_BENCHMARK(func)                 \
+  BENCHMARK_TEMPLATE(func, Shape::kDeepChain)    \
+      ->RangeMultiplier(4)                       \
+      ->Range(8, 512)                            \
+      ->Complexity();                            \
+  BENCHMARK_TEMPLATE(func, Shape::kWideSum)      \
+      ->RangeMultiplier(4)                       \
+      ->Range(8, 2048)                           \
+      ->Complexity();                            \
+  BENCHMARK_TEMPLATE(func, Shape::kNestedPowers) \
+      ->RangeMultiplier(4)                       \
+      ->Range(8, 512)                            \
+      ->Complexity();
+
+PIPELINE_BENCHMARK(BM_Parse)
+PIPELINE_BENCHMARK(BM_Differentiate)
+PIPELINE_BENCHMARK(BM_CachedDifferentiate)
+PIPELINE_BENCHMARK(BM_Optimize)
+PIPELINE_BENCHMARK(BM_Simplify)
+PIPELINE_BENCHMARK(BM_At)
+PIPELINE_BENCHMARK(BM_JitCompile)
+PIPELINE_BENCHMARK(BM_JitEvaluate)
+PIPELINE_BENCHMARK(BM_IncrementalEvaluate)
+PIPELINE_BENCHMARK(BM_Evaluate)
+PIPELINE_BENCHMARK(BM_FlatEvaluate)
+PIPELINE_BENCHMARK(BM_ToString)
+PIPELINE_BENCHMARK(BM_LaTeX)
+
+BENCHMARK(BM_DeepParse)
+    ->RangeMultiplier(10)
+    ->Range(1000, 1000000)
+    ->Unit(benchmark::kMillisecond)
+    ->Complexity();
+BENCHMARK(BM_DeepAt)
+    ->RangeMultiplier(10)
+    ->Range(1000, 1000000)
+    ->Unit(benchmark::kMillisecond)
+    ->Complexity();
+BENCHMARK(BM_RebalancedEvaluate)
+    ->ArgsProduct({{16, 256, 4096}, {0, 1}})
+    ->ArgNames({"terms", "rebalanced"});
+BENCHMARK(BM_RebalancedJitEvaluate)
+    ->ArgsProduct({{16, 256, 4096}, {0, 1}})
+    ->ArgNames({"terms", "rebalanced"});
+BENCHMARK(BM_ParallelDifferentiate)
+    ->ArgsProduct({{1024, 4096}, {0, 1, 2, 4, 8}})
+    ->ArgNames({"terms", "threads"})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK(BM_LazyDerivative)
+    ->ArgsProduct({{16, 256, 4096}, {0, 1}})
+    ->ArgNames({"terms", "evaluated"});
+BENCHMARK(BM_WidePrint)
+    ->RangeMultiplier(4)
+    ->Range(256, 65536)
+    ->Complexity();
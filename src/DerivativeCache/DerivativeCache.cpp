@@ -0,0 +1 @@
+#include "DerivativeCache.h"
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <memory>
+
+#include "../Differenctiator/Differentiator.h"
+#include "../String/String.h"
+#include "../UnorderedMap/UnorderedMap.h"
+#include "../Vector/Vector.h"
+
+// Remembers derivatives by the normalized text of the expression and the
+// variable. The least recently used results are evicted once their estimated
+// size exceeds the byte budget. Results are shared and never modified, so a
+// hit costs one normalization and one lookup. Like Differentiator, the cache
+// is used from one thread at a time.
+class DerivativeCache {
+ public:
+  explicit DerivativeCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  DerivativeCache(const DerivativeCache &) = delete;
+  DerivativeCache &operator=(const DerivativeCache &) = delete;
+
+  std::shared_ptr<const Formula> Differentiate(const String &expr,
+                                               const String &variable) {
+    auto key = MakeKey(expr, variable);
+    auto slot = slots_.find(key);
+    if (slot != slots_.end()) {
+      ++hits_;
+      Touch(slot->second);
+      return entries_[slot->second].formula_;
+    }
+
+    ++misses_;
+    auto formula = std::make_shared<const Formula>(
+        differentiator_.Differentiate(expr, variable));
+    size_t bytes = key.size() + formula->Size() * kNodeBytes;
+    if (bytes > max_bytes_) {
+      return formula;
+    }
+
+    while (bytes_ + bytes > max_bytes_) {
+      Evict();
+    }
+    Insert(std::move(key), formula, bytes);
+    return formula;
+  }
+
+  size_t Hits() const { return hits_; }
+
+  size_t Misses() const { return misses_; }
+
+  size_t Evictions() const { return evictions_; }
+
+  size_t Bytes() const { return bytes_; }
+
+  size_t Size() const { return slots_.size(); }
+
+  // Whitespace between tokens does not change the expression, so it is
+  // dropped unless it separates two names or numbers.
+  static String Normalize(const String &expr) {
+    String normal;
+    normal.reserve(expr.size());
+    bool pending_space = false;
+    for (char symbol : expr) {
+      if (symbol == ' ' || symbol == ',') {
+        pending_space = true;
+        continue;
+      }
+
+      if (pending_space && !normal.empty() && IsWordSymbol(normal.back()) &&
+          IsWordSymbol(symbol)) {
+        normal += ' ';
+      }
+      pending_space = false;
+      normal += symbol;
+    }
+    return normal;
+  }
+
+  // Identifies the derivative of expr by variable.
+  static String MakeKey(const String &expr, const String &variable) {
+    auto key = Normalize(expr);
+    key += '\n';
+    key += variable;
+    return key;
+  }
+
+ private:
+  struct Entry {
+    String key_;
+    std::shared_ptr<const Formula> formula_;
+    size_t bytes_ = 0;
+    size_t prev_ = kNone;
+    size_t next_ = kNone;
+  };
+
+  static bool IsWordSymbol(char symbol) {
+    return std::isalnum(static_cast<unsigned char>(symbol)) || symbol == '.';
+  }
+
+  void Insert(String key, std::shared_ptr<const Formula> formula,
+              size_t bytes) {
+    size_t slot;
+    if (free_slots_.empty()) {
+      slot = entries_.size();
+      entries_.push_back(Entry());
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+    }
+
+    auto &entry = entries_[slot];
+    entry.key_ = std::move(key);
+    entry.formula_ = std::move(formula);
+    entry.bytes_ = bytes;
+    slots_.insert({entry.key_, slot});
+    bytes_ += bytes;
+    Link(slot);
+  }
+
+  void Evict() {
+    size_t slot = oldest_;
+    auto &entry = entries_[slot];
+    Unlink(slot);
+    slots_.erase(entry.key_);
+    bytes_ -= entry.bytes_;
+    entry = Entry();
+    free_slots_.push_back(slot);
+    ++evictions_;
+  }
+
+  void Touch(size_t slot) {
+    if (slot != newest_) {
+      Unlink(slot);
+      Link(slot);
+    }
+  }
+
+  // Makes slot the most recently used entry.
+  void Link(size_t slot) {
+    auto &entry = entries_[slot];
+    entry.prev_ = newest_;
+    entry.next_ = kNone;
+    if (newest_ != kNone) {
+      entries_[newest_].next_ = slot;
+    } else {
+      oldest_ = slot;
+    }
+    newest_ = slot;
+  }
+
+  void Unlink(size_t slot) {
+    auto &entry = entries_[slot];
+    if (entry.prev_ != kNone) {
+      entries_[entry.prev_].next_ = entry.next_;
+    } else {
+      oldest_ = entry.next_;
+    }
+    if (entry.next_ != kNone) {
+      entries_[entry.next_].prev_ = entry.prev_;
+    } else {
+      newest_ = entry.prev_;
+    }
+  }
+
+  static const size_t kNone = SIZE_MAX;
+  // A tree node with its shared_ptr control block.
+  static const size_t kNodeBytes =
+      sizeof(Parser::ParseTree::Node) + 2 * sizeof(void *);
+
+  Differentiator differentiator_;
+  size_t max_bytes_;
+  size_t bytes_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  size_t evictions_ = 0;
+  UnorderedMap<String, size_t> slots_;
+  Vector<Entry> entries_;
+  Vector<size_t> free_slots_;
+  size_t oldest_ = kNone;
+  size_t newest_ = kNone;
+};
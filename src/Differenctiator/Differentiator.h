@@ -1,29 +1,35 @@
 #pragma once
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <sstream>
 
+#include "../EGraph/EGraph.h"
+#include "../ForkJoinPool/ForkJoinPool.h"
+#include "../Interval/Interval.h"
 #include "../Parser/Parser.h"
+#include "../Stats/Stats.h"
 #include "../String/String.h"
 #include "../Tree/Tree.h"
 #include "../UnorderedMap/UnorderedMap.h"
 #include "../UnorderedSet/UnorderedSet.h"
+#include "../VariableSet/VariableSet.h"
 #include "../Vector/Vector.h"
 
 #include <texcaller.h>
-#include <sstream>
 
 #define Braced(expr) String("(") + expr + String(")")
 
-#define OptimizeBraced(node) \
-  (node.is_simple_ ? node.expr_ : "(" + node.expr_ + ")")
-
-#define LaTeXOptimizeBraced(node) \
-  (node.is_simple_ ? node.expr_ : "\\left(" + node.expr_ + "\\right)")
-
-#define LaTeXBraced(expr) "\\left(" + expr + "\\right)"
-
 #define PLUS(expr_1, expr_2) expr_1 + "+" + expr_2
 
 #define MINUS(expr_1, expr_2) expr_1 + "-" + expr_2
@@ -32,24 +38,14 @@
 
 #define DIV(expr_1, expr_2) expr_1 + "/" + expr_2
 
-#define LaTeXDIV(expr_1, expr_2) "\\frac{" + expr_1 + "}{" + expr_2 + "}"
-
 #define POW(expr, pow) expr + "^" + pow
 
-#define LaTeXPOW(expr, pow) expr + "^{" + pow + "}"
-
 #define LOG(arg) String("log(") + arg + ")"
 
 #define COS(arg) String("cos(") + arg + ")"
 
 #define SIN(arg) String("sin(") + arg + ")"
 
-#define LaTeXLOG(arg) String("\\ln{") + arg + "}"
-
-#define LaTeXCOS(arg) String("\\cos{") + arg + "}"
-
-#define LaTeXSIN(arg) String("\\sin{") + arg + "}"
-
 #define ZERO String("0")
 
 class Formula {
@@ -61,576 +57,1789 @@ class Formula {
     }
   }
 
-  String ToString() {
-    using StringTree = Tree<StringTreeNode>;
-    StringTree string_tree = StringTree::CreateLike(
-        tree_, [this](const Parser::ParseTree::PostOrderIterator &formula_iter,
-                      StringTree::PostOrderIterator &string_iter) {
-          switch (formula_iter->value_->type_) {
-            case Parser::BaseTokenTypes::PLUS: {
-              const auto &left = string_iter->children_[0];
-              const auto &right = string_iter->children_[1];
-
-              string_iter->value_.expr_ =
-                  PLUS(left->value_.expr_, right->value_.expr_);
-              string_iter->value_.is_simple_ = false;
-            } break;
-
-            case Parser::BaseTokenTypes::MINUS: {
-              const auto &left = string_iter->children_[0];
-              const auto &right = string_iter->children_[1];
-
-              string_iter->value_.expr_ =
-                  MINUS(left->value_.expr_, right->value_.expr_);
-              string_iter->value_.is_simple_ = false;
-            } break;
-
-            case Parser::BaseTokenTypes::MULT: {
-              const auto &left = string_iter->children_[0];
-              const auto &right = string_iter->children_[1];
-
-              string_iter->value_.expr_ = MULT(OptimizeBraced(left->value_),
-                                               OptimizeBraced(right->value_));
-              string_iter->value_.is_simple_ = true;
-            } break;
-
-            case Parser::BaseTokenTypes::DIV: {
-              const auto &left = string_iter->children_[0];
-              const auto &right = string_iter->children_[1];
-
-              string_iter->value_.expr_ = DIV(OptimizeBraced(left->value_),
-                                              OptimizeBraced(right->value_));
-              string_iter->value_.is_simple_ = true;
-            } break;
-
-            case Parser::BaseTokenTypes::POW: {
-              const auto &left = string_iter->children_[0];
-              const auto &right = string_iter->children_[1];
-
-              string_iter->value_.expr_ = POW(OptimizeBraced(left->value_),
-                                              OptimizeBraced(right->value_));
-              string_iter->value_.is_simple_ = true;
-            } break;
-
-            case Parser::BaseTokenTypes::LOG: {
-              const auto &arg = string_iter->children_[0];
-
-              string_iter->value_.expr_ = LOG(arg->value_.expr_);
-              string_iter->value_.is_simple_ = true;
-            } break;
-
-            case Parser::BaseTokenTypes::SIN: {
-              const auto &arg = string_iter->children_[0];
-
-              string_iter->value_.expr_ = SIN(arg->value_.expr_);
-              string_iter->value_.is_simple_ = true;
-            } break;
-
-            case Parser::BaseTokenTypes::COS: {
-              const auto &arg = string_iter->children_[0];
-
-              string_iter->value_.expr_ = COS(arg->value_.expr_);
-              string_iter->value_.is_simple_ = true;
-            } break;
+  // Streams the formula in one pass over the tree; brackets are placed only
+  // where operator priorities require them. A formula that is one number is
+  // a value, like the ones At returns, and prints as a decimal.
+  void Print(std::ostream &out) const {
+    const auto &root = tree_.GetRoot();
+    if (root != nullptr &&
+        root->value_.Type() == Parser::BaseTokenTypes::NUMBER) {
+      root->value_.GetNumber().PrintValue(out);
+      return;
+    }
 
-            default: {
-              string_iter->value_.expr_ = formula_iter->value_->str_;
-              string_iter->value_.is_simple_ = true;
-            }
+    tree_.Traverse(
+        [&out](const Parser::ParseTree::Node &node,
+               const Parser::ParseTree::Node *parent, size_t id) {
+          if (parent != nullptr &&
+              NeedsBraces(parent->value_, node.value_, id)) {
+            out << '(';
+          }
+          if (node.value_.Info().is_function_) {
+            out << node.value_.Info().str_ << '(';
+          } else if (node.children_.empty()) {
+            node.value_.Print(out);
+          }
+        },
+        [&out](const Parser::ParseTree::Node &node, size_t) {
+          out << node.value_.Info().str_;
+        },
+        [&out](const Parser::ParseTree::Node &node,
+               const Parser::ParseTree::Node *parent, size_t id) {
+          if (node.value_.Info().is_function_) {
+            out << ')';
+          }
+          if (parent != nullptr &&
+              NeedsBraces(parent->value_, node.value_, id)) {
+            out << ')';
           }
         });
+  }
 
-    return string_tree.GetRoot()->value_.expr_;
+  String ToString() const {
+    std::stringstream out;
+    Print(out);
+    return out.str();
   }
 
-  void ToPDF(const String &filename) {
-    std::ofstream out;
+  friend std::ostream &operator<<(std::ostream &out, const Formula &formula) {
+    formula.Print(out);
+    return out;
+  }
 
+  // A .tex filename receives the LaTeX source, anything else the rendered
+  // PDF, which replaces the file atomically once it is complete.
+  bool ToPDF(const String &filename, Stats *stats = nullptr) const {
     if (filename.find(".tex") != filename.npos) {
-      out.open(filename.c_str());
-    } else {
-      out.open("tmp.tex");
+      Stats::PhaseScope latex(stats, "latex");
+      std::ofstream out(filename.c_str());
+      PrintLaTeXDocument(out);
+      out.close();
+      return !out.fail();
     }
 
-    out << "\\documentclass{article}\n"
-           "\\usepackage[T1,T2A]{fontenc}\n"
-           "\\usepackage[utf8]{inputenc}\n"
-           "\\usepackage[english,russian]{babel}\n"
-           "\\usepackage{amsmath}\n"
-           "\\begin{document}\n"
-           "\\[\n"
-           "\\boxed{";
-
-    out << GetLaTeX();
-
-    out << "}\n"
-           "\\]\n"
-           "\\begin{center}"
-           "Утрем нос Стивену Вольфраму!(нет)"
-           "\\end{center}"
-           "\\end{document}";
+    auto pdf = ToPDFBytes(nullptr, stats);
+    return pdf && WriteAtomically(filename, pdf.value());
+  }
 
-    out.close();
+  // Renders in memory: the LaTeX source is passed to TexCaller as a buffer
+  // and the PDF comes back as bytes, so concurrent calls share no files. On
+  // failure TeX's diagnostics are stored in info, if it is given.
+  std::optional<String> ToPDFBytes(String *info = nullptr,
+                                   Stats *stats = nullptr) const {
+    Stats::PhaseScope latex(stats, "latex");
+    std::stringstream source_stream;
+    PrintLaTeXDocument(source_stream);
+    String source = source_stream.str();
+    latex.Stop();
+
+    Stats::PhaseScope tex(stats, "tex");
+    char *result = nullptr;
+    size_t result_size = 0;
+    char *result_info = nullptr;
+    texcaller_convert(&result, &result_size, &result_info, source.data(),
+                      source.size(), "LaTeX", "PDF", kMaxTeXRuns);
+
+    if (info != nullptr && result_info != nullptr) {
+      *info = result_info;
+    }
+    free(result_info);
 
-    if (filename.find(".tex") == filename.npos) {
-      texcaller_to_pdf("LaTeX", "PDF", 5, "tmp.tex", filename.c_str());
-      std::remove("tmp.tex");
+    if (result == nullptr) {
+      return {};
     }
+
+    String pdf(result, result_size);
+    free(result);
+    return pdf;
   }
 
   Formula At(const UnorderedMap<String, String> &variables) const {
-    auto tree = Parser::ParseTree::CreateLike(
-        tree_, [this, &variables](
-                   const Parser::ParseTree::PostOrderIterator &formula_iter,
-                   Parser::ParseTree::PostOrderIterator &mapped_formula_iter) {
-          switch (formula_iter->value_->type_) {
-            case Parser::BaseTokenTypes::VARIABLE: {
-              mapped_formula_iter->value_ = formula_iter->value_;
-
-              auto var_iter = variables.find(formula_iter->value_->str_);
-              if (var_iter != variables.end()) {
-                mapped_formula_iter->value_ =
-                    parser_.AddToken({.type_ = Parser::BaseTokenTypes::NUMBER,
-                                      .str_ = var_iter->second,
-                                      .priority_ = 0,
-                                      .operands_number_ = 0,
-                                      .is_function = false});
-              }
-            } break;
-
-            default: {
-              mapped_formula_iter->value_ = formula_iter->value_;
-            }
-          }
-        });
+    Vector<std::optional<Parser::TokenRef>> values(parser_.SymbolsNumber());
+    for (size_t id = 0; id < values.size(); ++id) {
+      auto var_iter = variables.find(parser_.GetSymbolName(id));
+      if (var_iter != variables.end()) {
+        values[id] = parser_.AddNumber(Number::Parse(var_iter->second));
+      }
+    }
 
-    auto result = Formula(std::move(tree));
-    result.Optimize();
-    return result;
+    return At(values);
   }
 
-  const Parser::ParseTree &GetTree() const { return tree_; }
-
-  void Optimize() {
-    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
-      if (node->children_.size() == 2) {
-        const auto &left = node->children_[0];
-        const auto &right = node->children_[1];
-        if (left->value_->type_ == Parser::BaseTokenTypes::NUMBER &&
-            right->value_->type_ == Parser::BaseTokenTypes::NUMBER) {
-          auto result = HandleNumbers(left->value_->str_, right->value_->str_,
-                                      node->value_->type_);
-          auto token =
-              parser_.AddToken({.type_ = Parser::BaseTokenTypes::NUMBER,
-                                .str_ = std::move(result),
-                                .priority_ = 0,
-                                .operands_number_ = 0,
-                                .is_function = false});
-          tree_.Replace(node, std::make_shared<Parser::ParseTree::Node>(token));
-
-          continue;
-        }
-      }
-
-      if (node->children_.size() == 1) {
-        const auto &arg = node->children_[0];
-        if (arg->value_->type_ == Parser::BaseTokenTypes::NUMBER) {
-          auto result = HandleNumbers(arg->value_->str_, node->value_->type_);
-          auto token =
-              parser_.AddToken({.type_ = Parser::BaseTokenTypes::NUMBER,
-                                .str_ = std::move(result),
-                                .priority_ = 0,
-                                .operands_number_ = 0,
-                                .is_function = false});
-          tree_.Replace(node, std::make_shared<Parser::ParseTree::Node>(token));
-
-          continue;
-        }
-      }
-
-      switch (node->value_->type_) {
-        case Parser::BaseTokenTypes::PLUS: {
-          const auto &left = node->children_[0];
-          const auto &right = node->children_[1];
-
-          if (left->value_->str_ == "0") {
-            tree_.Replace(node, tree_.ExtractSubTree(right).GetRoot());
-            break;
-          }
-
-          if (right->value_->str_ == "0") {
-            tree_.Replace(node, tree_.ExtractSubTree(left).GetRoot());
-            break;
-          }
-        } break;
-
-        case Parser::BaseTokenTypes::MINUS: {
-          const auto &left = node->children_[0];
-          const auto &right = node->children_[1];
-
-          if (right->value_->str_ == "0") {
-            tree_.Replace(node, tree_.ExtractSubTree(left).GetRoot());
-            break;
-          }
-        } break;
-
-        case Parser::BaseTokenTypes::MULT: {
-          const auto &left = node->children_[0];
-          const auto &right = node->children_[1];
-
-          if (left->value_->str_ == "1") {
-            tree_.Replace(node, tree_.ExtractSubTree(right).GetRoot());
-            break;
-          }
-
-          if (right->value_->str_ == "1") {
-            tree_.Replace(node, tree_.ExtractSubTree(left).GetRoot());
-            break;
-          }
-
-          if (left->value_->str_ == "0") {
-            tree_.Replace(node, tree_.ExtractSubTree(left).GetRoot());
-            break;
-          }
-
-          if (right->value_->str_ == "0") {
-            tree_.Replace(node, tree_.ExtractSubTree(right).GetRoot());
-            break;
-          }
-        } break;
-
-        case Parser::BaseTokenTypes::DIV: {
-          const auto &left = node->children_[0];
-          const auto &right = node->children_[1];
+  // How Evaluate adds the operands of a flattened sum: in independent lanes,
+  // pairwise (the error grows with log n instead of n) or with compensation
+  // (the error does not grow with n). Binary chains are added in tree order;
+  // Rebalance gives them the pairwise one.
+  enum class Summation { kLanes, kPairwise, kKahan };
+
+  long double Evaluate(const UnorderedMap<String, long double> &variables,
+                       Summation summation = Summation::kLanes) const {
+    Vector<long double> values(parser_.SymbolsNumber());
+    for (size_t id = 0; id < values.size(); ++id) {
+      auto var_iter = variables.find(parser_.GetSymbolName(id));
+      values[id] = var_iter != variables.end() ? var_iter->second : NAN;
+    }
 
-          if (left->value_->str_ == "0") {
-            tree_.Replace(node, tree_.ExtractSubTree(left).GetRoot());
-            break;
-          }
+    return Evaluate(values, summation);
+  }
 
-          if (right->value_->str_ == "1") {
-            tree_.Replace(node, tree_.ExtractSubTree(left).GetRoot());
-            break;
-          }
+  // values are indexed by variable ids, see FindVariable.
+  long double Evaluate(const Vector<long double> &values,
+                       Summation summation = Summation::kLanes) const {
+    Vector<long double> stack;
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      // Operators are known by the handle alone, only leaves load a payload.
+      auto token = node->value_;
+      int type = token.Type();
+      switch (type) {
+        case Parser::BaseTokenTypes::NUMBER: {
+          stack.push_back(token.GetNumber().GetValue());
         } break;
 
-        case Parser::BaseTokenTypes::POW: {
-          const auto &left = node->children_[0];
-          const auto &right = node->children_[1];
-
-          if (left->value_->str_ == "0") {
-            tree_.Replace(node, tree_.ExtractSubTree(left).GetRoot());
-            break;
-          }
-
-          if (left->value_->str_ == "1") {
-            tree_.Replace(node, tree_.ExtractSubTree(left).GetRoot());
-            break;
-          }
-
-          if (right->value_->str_ == "1") {
-            tree_.Replace(node, tree_.ExtractSubTree(left).GetRoot());
-            break;
-          }
-
-          if (right->value_->str_ == "0") {
-            auto token =
-                parser_.AddToken({.type_ = Parser::BaseTokenTypes::NUMBER,
-                                  .str_ = "1",
-                                  .priority_ = 0,
-                                  .operands_number_ = 0,
-                                  .is_function = false});
-            tree_.Replace(node,
-                          std::make_shared<Parser::ParseTree::Node>(token));
-            break;
-          }
+        case Parser::BaseTokenTypes::VARIABLE: {
+          stack.push_back(token.GetSymbolId() < values.size()
+                              ? values[token.GetSymbolId()]
+                              : NAN);
         } break;
 
         default: {
+          size_t operands_number = node->children_.size();
+          if (operands_number == 1) {
+            stack.back() = Calculate(stack.back(), type);
+          } else if (operands_number == 2) {
+            auto right = stack.back();
+            stack.pop_back();
+            stack.back() = Calculate(stack.back(), right, type);
+          } else {
+            auto result = Reduce(stack.end() - operands_number,
+                                 operands_number, type, summation);
+            for (size_t i = 1; i < operands_number; ++i) {
+              stack.pop_back();
+            }
+            stack.back() = result;
+          }
         }
       }
     }
-  }
 
- private:
-  struct StringTreeNode {
-    String expr_;
-    bool is_simple_ = true;
-  };
-
-  explicit Formula(Parser::ParseTree tree) : tree_(std::move(tree)) {}
+    return stack.back();
+  }
 
-  static String HandleNumbers(const String &left_str, const String &right_str,
-                              int operation) {
-    auto left = std::stold(left_str);
-    auto right = std::stold(right_str);
-    std::stringstream stringstream;
+  // Applies a binary or a function token type to evaluated operands.
+  static long double Calculate(long double left, long double right,
+                               int operation) {
     switch (operation) {
       case Parser::BaseTokenTypes::PLUS: {
-        stringstream << left + right;
-      } break;
+        return left + right;
+      }
       case Parser::BaseTokenTypes::MINUS: {
-        stringstream << left - right;
-      } break;
+        return left - right;
+      }
       case Parser::BaseTokenTypes::MULT: {
-        stringstream << left * right;
-      } break;
+        return left * right;
+      }
       case Parser::BaseTokenTypes::DIV: {
-        stringstream << left / right;
-      } break;
+        return left / right;
+      }
       case Parser::BaseTokenTypes::POW: {
-        stringstream << powl(left, right);
-      } break;
+        return powl(left, right);
+      }
       default: {
+        return NAN;
       }
     }
-
-    return stringstream.str();
   }
 
-  static String HandleNumbers(const String &arg_str, int operation) {
-    auto arg = std::stold(arg_str);
-    std::stringstream stringstream;
+  static long double Calculate(long double arg, int operation) {
     switch (operation) {
       case Parser::BaseTokenTypes::LOG: {
-        stringstream << std::log(arg);
-      } break;
+        return std::log(arg);
+      }
       case Parser::BaseTokenTypes::SIN: {
-        stringstream << std::sin(arg);
-      } break;
+        return std::sin(arg);
+      }
       case Parser::BaseTokenTypes::COS: {
-        stringstream << std::cos(arg);
-      } break;
+        return std::cos(arg);
+      }
       default: {
+        return NAN;
       }
     }
+  }
 
-    return stringstream.str();
+  // Overwrites operands when the sum is pairwise.
+  static long double Reduce(long double *operands, size_t operands_number,
+                            int operation, Summation summation) {
+    if (operation == Parser::BaseTokenTypes::PLUS) {
+      if (summation == Summation::kPairwise) {
+        return PairwiseSum(operands, operands_number);
+      }
+      if (summation == Summation::kKahan) {
+        return KahanSum(operands, operands_number);
+      }
+    }
+    return Reduce<long double>(operands, operands_number, operation);
   }
 
-  String GetLaTeX() {
-    using LaTeXTree = Tree<StringTreeNode>;
-    LaTeXTree latex_tree = LaTeXTree::CreateLike(
-        tree_, [this](const Parser::ParseTree::PostOrderIterator &formula_iter,
-                      LaTeXTree::PostOrderIterator &latex_iter) {
-          switch (formula_iter->value_->type_) {
-            case Parser::BaseTokenTypes::PLUS: {
-              const auto &left = latex_iter->children_[0];
-              const auto &right = latex_iter->children_[1];
+  // Folds the evaluated operands of a flattened sum or product.
+  template <class T>
+  static T Reduce(const T *operands, size_t operands_number, int operation) {
+    if (operation == Parser::BaseTokenTypes::PLUS) {
+      return Reduce(operands, operands_number, std::plus<T>());
+    }
+    return Reduce(operands, operands_number, std::multiplies<T>());
+  }
 
-              latex_iter->value_.expr_ =
-                  PLUS(left->value_.expr_, right->value_.expr_);
-              latex_iter->value_.is_simple_ = false;
-            } break;
+  // Guaranteed range of the formula over a box of variables; unbound
+  // variables may take any value.
+  Interval Enclose(const UnorderedMap<String, Interval> &variables) const {
+    Vector<Interval> values(parser_.SymbolsNumber());
+    for (size_t id = 0; id < values.size(); ++id) {
+      auto var_iter = variables.find(parser_.GetSymbolName(id));
+      values[id] =
+          var_iter != variables.end() ? var_iter->second : Interval::Entire();
+    }
 
-            case Parser::BaseTokenTypes::MINUS: {
-              const auto &left = latex_iter->children_[0];
-              const auto &right = latex_iter->children_[1];
+    return Enclose(values);
+  }
 
-              latex_iter->value_.expr_ =
-                  MINUS(left->value_.expr_, LaTeXOptimizeBraced(right->value_));
-              latex_iter->value_.is_simple_ = false;
-            } break;
+  // values are indexed by variable ids, like in Evaluate.
+  Interval Enclose(const Vector<Interval> &values) const {
+    if (tree_.GetRoot() == nullptr) {
+      return Interval::Empty();
+    }
 
-            case Parser::BaseTokenTypes::MULT: {
-              const auto &left = latex_iter->children_[0];
-              const auto &right = latex_iter->children_[1];
+    Vector<Interval> stack;
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      auto token = node->value_;
+      switch (token.Type()) {
+        case Parser::BaseTokenTypes::NUMBER: {
+          stack.push_back(Interval::FromNumber(token.GetNumber()));
+        } break;
 
-              latex_iter->value_.expr_ =
-                  MULT(LaTeXOptimizeBraced(left->value_),
-                       LaTeXOptimizeBraced(right->value_));
-              latex_iter->value_.is_simple_ = true;
-            } break;
+        case Parser::BaseTokenTypes::VARIABLE: {
+          stack.push_back(token.GetSymbolId() < values.size()
+                              ? values[token.GetSymbolId()]
+                              : Interval::Entire());
+        } break;
 
-            case Parser::BaseTokenTypes::DIV: {
-              const auto &left = latex_iter->children_[0];
-              const auto &right = latex_iter->children_[1];
+        default: {
+          size_t operands_number = node->children_.size();
+          if (operands_number == 1) {
+            stack.back() = Calculate(stack.back(), token.Type());
+          } else if (operands_number == 2) {
+            auto right = stack.back();
+            stack.pop_back();
+            stack.back() = Calculate(stack.back(), right, token.Type());
+          } else {
+            auto result = Reduce(stack.end() - operands_number,
+                                 operands_number, token.Type());
+            for (size_t i = 1; i < operands_number; ++i) {
+              stack.pop_back();
+            }
+            stack.back() = result;
+          }
+        }
+      }
+    }
 
-              latex_iter->value_.expr_ =
-                  LaTeXDIV(left->value_.expr_, right->value_.expr_);
-              latex_iter->value_.is_simple_ = true;
-            } break;
+    return stack.back();
+  }
 
-            case Parser::BaseTokenTypes::POW: {
-              const auto &left = latex_iter->children_[0];
-              const auto &right = latex_iter->children_[1];
+  // Length of a values vector indexed by variable ids that covers every
+  // variable of the formula.
+  size_t ValuesNumber() const {
+    size_t values_number = 0;
+    tree_.Traverse(
+        [&values_number](const Parser::ParseTree::Node &node,
+                         const Parser::ParseTree::Node *, size_t) {
+          if (node.value_.Type() == Parser::BaseTokenTypes::VARIABLE) {
+            values_number =
+                std::max(values_number, node.value_.GetSymbolId() + 1);
+          }
+        },
+        [](const Parser::ParseTree::Node &, size_t) {},
+        [](const Parser::ParseTree::Node &, const Parser::ParseTree::Node *,
+           size_t) {});
+    return values_number;
+  }
 
-              latex_iter->value_.expr_ = LaTeXPOW(
-                  LaTeXOptimizeBraced(left->value_), right->value_.expr_);
-              latex_iter->value_.is_simple_ = false;
-            } break;
+  static std::optional<size_t> FindVariable(const String &name) {
+    return parser_.FindSymbol(name);
+  }
 
-            case Parser::BaseTokenTypes::LOG: {
-              const auto &arg = latex_iter->children_[0];
+  const Parser::ParseTree &GetTree() const { return tree_; }
 
-              latex_iter->value_.expr_ =
-                  LaTeXLOG(LaTeXBraced(arg->value_.expr_));
-              latex_iter->value_.is_simple_ = true;
-            } break;
+  size_t Size() const {
+    size_t size = 0;
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      ++size;
+    }
+    return size;
+  }
 
-            case Parser::BaseTokenTypes::SIN: {
-              const auto &arg = latex_iter->children_[0];
+  // Nodes on the longest path from the root to a leaf.
+  size_t Depth() const {
+    size_t depth = 0;
+    size_t max_depth = 0;
+    tree_.Traverse(
+        [&](const Parser::ParseTree::Node &, const Parser::ParseTree::Node *,
+            size_t) { max_depth = std::max(max_depth, ++depth); },
+        [](const Parser::ParseTree::Node &, size_t) {},
+        [&depth](const Parser::ParseTree::Node &,
+                 const Parser::ParseTree::Node *, size_t) { --depth; });
+    return max_depth;
+  }
 
-              latex_iter->value_.expr_ =
-                  LaTeXSIN(LaTeXBraced(arg->value_.expr_));
-              latex_iter->value_.is_simple_ = true;
+  // Streams the LaTeX of the formula in one pass, like Print.
+  void PrintLaTeX(std::ostream &out) const {
+    tree_.Traverse(
+        [&out](const Parser::ParseTree::Node &node,
+               const Parser::ParseTree::Node *parent, size_t id) {
+          if (parent != nullptr &&
+              NeedsLaTeXBraces(parent->value_, node.value_, id)) {
+            out << "\\left(";
+          }
+          switch (node.value_.Type()) {
+            case Parser::BaseTokenTypes::DIV: {
+              out << "\\frac{";
+            } break;
+            case Parser::BaseTokenTypes::LOG: {
+              out << "\\ln{\\left(";
+            } break;
+            case Parser::BaseTokenTypes::SIN: {
+              out << "\\sin{\\left(";
             } break;
-
             case Parser::BaseTokenTypes::COS: {
-              const auto &arg = latex_iter->children_[0];
-
-              latex_iter->value_.expr_ =
-                  LaTeXCOS(LaTeXBraced(arg->value_.expr_));
-              latex_iter->value_.is_simple_ = true;
+              out << "\\cos{\\left(";
+            } break;
+            default: {
+              if (node.children_.empty()) {
+                node.value_.Print(out);
+              }
+            }
+          }
+        },
+        [&out](const Parser::ParseTree::Node &node, size_t) {
+          switch (node.value_.Type()) {
+            case Parser::BaseTokenTypes::DIV: {
+              out << "}{";
+            } break;
+            case Parser::BaseTokenTypes::POW: {
+              out << "^{";
             } break;
-
             default: {
-              latex_iter->value_.expr_ = formula_iter->value_->str_;
-              latex_iter->value_.is_simple_ = true;
+              out << node.value_.Info().str_;
             }
           }
+        },
+        [&out](const Parser::ParseTree::Node &node,
+               const Parser::ParseTree::Node *parent, size_t id) {
+          if (node.value_.Info().is_function_) {
+            out << "\\right)}";
+          } else if (node.value_.Type() == Parser::BaseTokenTypes::DIV ||
+                     node.value_.Type() == Parser::BaseTokenTypes::POW) {
+            out << "}";
+          }
+          if (parent != nullptr &&
+              NeedsLaTeXBraces(parent->value_, node.value_, id)) {
+            out << "\\right)";
+          }
         });
+  }
 
-    return latex_tree.GetRoot()->value_.expr_;
+  String GetLaTeX() const {
+    std::stringstream out;
+    PrintLaTeX(out);
+    return out.str();
   }
 
-  static Parser parser_;
-  Parser::ParseTree tree_;
-};
+  // Straight-line C99 source defining
+  //   double name(const double *values);
+  //   void name_array(const double *points, size_t count, size_t stride,
+  //                   double *results);
+  // values are indexed by variable ids like in Evaluate; name_array evaluates
+  // count points laid out stride values apart. Equal subtrees are computed
+  // once into shared locals.
+  void EmitC(std::ostream &out, const String &name) const {
+    out << "#include <math.h>\n#include <stddef.h>\n\n"
+        << "double " << name << "(const double *values) {\n";
+
+    Vector<size_t> stack;
+    if (tree_.GetRoot() != nullptr) {
+      stack = EmitCBody(out);
+    }
 
-// Parser Formula::parser_ = Parser();
+    if (stack.empty()) {
+      out << "  return NAN;\n}\n\n";
+    } else {
+      out << "  return t" << stack.back() << ";\n}\n\n";
+    }
 
-class Differentiator {
- public:
-  Differentiator() = default;
+    out << "void " << name << "_array(const double *points, size_t count, "
+        << "size_t stride, double *results) {\n"
+        << "  for (size_t i = 0; i < count; ++i) {\n"
+        << "    results[i] = " << name << "(points + i * stride);\n"
+        << "  }\n}\n";
+  }
 
-  Formula Differentiate(const String &expr, String variable) {
-    variable_ = std::move(variable);
+  String EmitC(const String &name) const {
+    std::stringstream out;
+    EmitC(out, name);
+    return out.str();
+  }
 
-    auto formula = Formula(expr);  // TODO: удалить эту строку
+  void PrintLaTeXDocument(std::ostream &out) const {
+    out << "\\documentclass{article}\n"
+           "\\usepackage[T1,T2A]{fontenc}\n"
+           "\\usepackage[utf8]{inputenc}\n"
+           "\\usepackage[english,russian]{babel}\n"
+           "\\usepackage{amsmath}\n"
+           "\\begin{document}\n"
+           "\\[\n"
+           "\\boxed{";
 
-    tree_ = Tree<NodeState>::CreateLike(
-        formula.GetTree(),
-        [this](const Parser::ParseTree::PostOrderIterator &expr_iter,
-               Tree<NodeState>::PostOrderIterator &diff_iter) {
-          ProcessNode(diff_iter, expr_iter);
-        });
+    PrintLaTeX(out);
 
-    auto result = Formula(tree_.GetRoot()->value_.diff_);
-    result.Optimize();
-    return result;
+    out << "}\n"
+           "\\]\n"
+           "\\begin{center}"
+           "Утрем нос Стивену Вольфраму!(нет)"
+           "\\end{center}"
+           "\\end{document}";
   }
 
- private:
-  struct NodeState {
-    String normal_;
-    String diff_;
-  };
+  // Binary form of the tree: a header, the label, the names of the variables,
+  // the constants and one 64-bit opcode per node in post-order (the token type
+  // in the low byte, the index of the name or the constant above it, or the
+  // number of operands of a flattened sum or product). Fields
+  // are written in the native byte order, so loading copies fixed-size records
+  // out of a buffer, e.g. a mapped file, without going through the parser.
+  void Serialize(std::ostream &out, const String &label = String()) const {
+    Vector<std::optional<uint32_t>> symbols_indices(parser_.SymbolsNumber());
+    Vector<uint32_t> symbols;
+    Vector<const Number *> constants;
+    Vector<uint64_t> opcodes;
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      auto token = node->value_;
+      uint64_t index = 0;
+      if (token.Type() == Parser::BaseTokenTypes::VARIABLE) {
+        auto &symbol_index = symbols_indices[token.GetSymbolId()];
+        if (!symbol_index) {
+          symbol_index = symbols.size();
+          symbols.push_back(token.GetSymbolId());
+        }
+        index = symbol_index.value();
+      } else if (token.Type() == Parser::BaseTokenTypes::NUMBER) {
+        index = constants.size();
+        constants.push_back(&token.GetNumber());
+      } else if (node->children_.size() > token.Info().operands_number_) {
+        index = node->children_.size();
+      }
+      opcodes.push_back(token.Type() | index << kOpcodeTypeBits);
+    }
 
-  void ProcessNode(Tree<NodeState>::PostOrderIterator &cur_iter,
-                   const Parser::ParseTree::PostOrderIterator &expr_iter) {
-    auto &current = cur_iter->value_;
+    out.write(kSerializationMagic, sizeof(kSerializationMagic));
+    WriteRaw(out, kSerializationVersion);
+    WriteRaw<uint32_t>(out, sizeof(long double));
+    WriteRaw<uint32_t>(out, label.size());
+    WriteRaw<uint32_t>(out, symbols.size());
+    WriteRaw<uint32_t>(out, constants.size());
+    WriteRaw<uint32_t>(out, opcodes.size());
+    out.write(label.data(), label.size());
+
+    for (auto symbol_id : symbols) {
+      const auto &name = parser_.GetSymbolName(symbol_id);
+      WriteRaw<uint32_t>(out, name.size());
+      out.write(name.data(), name.size());
+    }
 
-    switch (expr_iter->value_->type_) {
-      case Parser::BaseTokenTypes::PLUS: {
-        const auto &left = cur_iter->children_[0]->value_;
-        const auto &right = cur_iter->children_[1]->value_;
+    for (const auto *number : constants) {
+      const auto &exact = number->GetExact();
+      WriteRaw<int64_t>(out, exact ? exact->numerator_ : 0);
+      WriteRaw<int64_t>(out, exact ? exact->denominator_ : 0);
+      WriteRaw(out, number->GetValue());
+    }
 
-        current.diff_ = PLUS(left.diff_, right.diff_);
-        current.normal_ = PLUS(left.normal_, right.normal_);
-      } break;
+    for (auto opcode : opcodes) {
+      WriteRaw(out, opcode);
+    }
+  }
 
-      case Parser::BaseTokenTypes::MINUS: {
-        const auto &left = cur_iter->children_[0]->value_;
-        const auto &right = cur_iter->children_[1]->value_;
+  // Rebuilds a formula written by Serialize. Fails on malformed data and
+  // when the stored label differs from label.
+  static std::optional<Formula> Deserialize(const char *data, size_t size,
+                                            const String &label = String()) {
+    BinaryReader reader{data, size};
+    char magic[sizeof(kSerializationMagic)];
+    uint32_t version, long_double_size, label_size, symbols_number,
+        constants_number, nodes_number;
+    if (!reader.Read(magic, sizeof(magic)) ||
+        std::memcmp(magic, kSerializationMagic, sizeof(magic)) != 0 ||
+        !reader.Read(&version) || version != kSerializationVersion ||
+        !reader.Read(&long_double_size) ||
+        long_double_size != sizeof(long double) ||
+        !reader.Read(&label_size) || !reader.Read(&symbols_number) ||
+        !reader.Read(&constants_number) || !reader.Read(&nodes_number) ||
+        label_size != label.size() || !reader.Skip(label, label_size)) {
+      return {};
+    }
 
-        current.diff_ = MINUS(left.diff_, right.diff_);
-        current.normal_ = MINUS(left.normal_, right.normal_);
-      } break;
+    Vector<Parser::TokenRef> variables;
+    for (uint32_t i = 0; i < symbols_number; ++i) {
+      uint32_t name_size;
+      String name;
+      if (!reader.Read(&name_size) || !reader.Read(&name, name_size)) {
+        return {};
+      }
+      auto variable = parser_.GetVariable(name);
+      if (!variable) {
+        return {};
+      }
+      variables.push_back(variable.value());
+    }
 
-      case Parser::BaseTokenTypes::MULT: {
-        const auto &left = cur_iter->children_[0]->value_;
-        const auto &right = cur_iter->children_[1]->value_;
+    Vector<Parser::TokenRef> constants;
+    for (uint32_t i = 0; i < constants_number; ++i) {
+      int64_t numerator, denominator;
+      long double value;
+      if (!reader.Read(&numerator) || !reader.Read(&denominator) ||
+          !reader.Read(&value)) {
+        return {};
+      }
+      constants.push_back(parser_.AddNumber(
+          denominator != 0 ? Number(numerator, denominator) : Number(value)));
+    }
 
-        current.diff_ = PLUS(MULT(Braced(left.diff_), Braced(right.normal_)),
-                             MULT(Braced(right.diff_), Braced(left.normal_)));
-        current.normal_ = MULT(Braced(left.normal_), Braced(right.normal_));
-      } break;
+    Vector<Parser::ParseTree::Node::Ptr> stack;
+    for (uint32_t i = 0; i < nodes_number; ++i) {
+      uint64_t opcode;
+      if (!reader.Read(&opcode)) {
+        return {};
+      }
+
+      int type = opcode & ((1 << kOpcodeTypeBits) - 1);
+      uint64_t index = opcode >> kOpcodeTypeBits;
+      std::optional<Parser::TokenRef> token;
+      size_t operands_number = 0;
+      if (type == Parser::BaseTokenTypes::VARIABLE) {
+        if (index < variables.size()) {
+          token = variables[index];
+        }
+      } else if (type == Parser::BaseTokenTypes::NUMBER) {
+        if (index < constants.size()) {
+          token = constants[index];
+        }
+      } else if (index == 0 || (index > 2 && IsFlattenable(type))) {
+        token = parser_.GetOperator(type);
+        operands_number =
+            token && index == 0 ? token->Info().operands_number_ : index;
+      }
+      if (!token || stack.size() < operands_number) {
+        return {};
+      }
+
+      auto node = std::make_shared<Parser::ParseTree::Node>(token.value());
+      for (size_t j = stack.size() - operands_number; j < stack.size(); ++j) {
+        Parser::ParseTree::Node::Attach(node, stack[j]);
+      }
+      stack.resize(stack.size() - operands_number);
+      stack.push_back(std::move(node));
+    }
+
+    if (stack.size() > 1 || !reader.AtEnd()) {
+      return {};
+    }
+
+    return Formula(stack.empty() ? Parser::ParseTree()
+                                 : Parser::ParseTree(stack.back()));
+  }
+
+  bool Save(const String &filename, const String &label = String()) const {
+    std::stringstream out;
+    Serialize(out, label);
+    return WriteAtomically(filename, out.str());
+  }
+
+  // Maps the file instead of reading it into a buffer.
+  static std::optional<Formula> Load(const String &filename,
+                                     const String &label = String()) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return {};
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+      close(fd);
+      return {};
+    }
+
+    size_t size = file_stat.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return {};
+    }
+
+    auto result = Deserialize(static_cast<const char *>(data), size, label);
+    munmap(data, size);
+    return result;
+  }
+
+  // Merges chains of sums and of products into single nodes that keep every
+  // operand as a child, so a+b+c+d is one PLUS node with four children.
+  // Every method of Formula accepts flattened trees.
+  void Flatten() {
+    if (tree_.GetRoot() == nullptr) {
+      return;
+    }
+
+    Vector<Parser::ParseTree::Node::Ptr> stack;
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      auto token = node->value_;
+      bool flattenable = IsFlattenable(token.Type());
+      size_t operands_number = node->children_.size();
+      size_t first = stack.size() - operands_number;
+      Parser::ParseTree::Node::Ptr flat;
+      // A flattened first operand takes the rest of the operands itself, so
+      // the left-deep chains of the parser flatten in linear time.
+      if (flattenable && operands_number > 0 &&
+          stack[first]->value_.Type() == token.Type()) {
+        flat = std::move(stack[first++]);
+      } else {
+        flat = std::make_shared<Parser::ParseTree::Node>(token);
+      }
+      for (size_t j = first; j < stack.size(); ++j) {
+        if (flattenable && stack[j]->value_.Type() == token.Type()) {
+          for (const auto &operand : stack[j]->children_) {
+            Parser::ParseTree::Node::Attach(flat, operand);
+          }
+        } else {
+          Parser::ParseTree::Node::Attach(flat, stack[j]);
+        }
+      }
+      for (size_t j = 0; j < operands_number; ++j) {
+        stack.pop_back();
+      }
+      stack.push_back(std::move(flat));
+    }
+    tree_ = Parser::ParseTree(stack.back());
+  }
+
+  // Replaces every chain of sums or of products by a balanced tree of binary
+  // nodes over the same operands in the same order: a chain of n operands
+  // gets depth log n, which shortens the critical path of evaluation and
+  // makes sums pairwise.
+  void Rebalance() {
+    Flatten();
+    if (tree_.GetRoot() == nullptr) {
+      return;
+    }
+
+    Vector<Parser::ParseTree::Node::Ptr> stack;
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      Vector<Parser::ParseTree::Node::Ptr> operands;
+      size_t operands_number = node->children_.size();
+      for (size_t j = stack.size() - operands_number; j < stack.size(); ++j) {
+        operands.push_back(std::move(stack[j]));
+      }
+      for (size_t j = 0; j < operands_number; ++j) {
+        stack.pop_back();
+      }
+
+      while (operands.size() > 2) {
+        size_t paired = 0;
+        for (size_t j = 0; j + 1 < operands.size(); j += 2) {
+          auto pair = std::make_shared<Parser::ParseTree::Node>(node->value_);
+          Parser::ParseTree::Node::Attach(pair, std::move(operands[j]));
+          Parser::ParseTree::Node::Attach(pair, std::move(operands[j + 1]));
+          operands[paired++] = std::move(pair);
+        }
+        if (operands.size() % 2 == 1) {
+          operands[paired++] = std::move(operands.back());
+        }
+        while (operands.size() > paired) {
+          operands.pop_back();
+        }
+      }
+
+      auto balanced = std::make_shared<Parser::ParseTree::Node>(node->value_);
+      for (auto &operand : operands) {
+        Parser::ParseTree::Node::Attach(balanced, std::move(operand));
+      }
+      stack.push_back(std::move(balanced));
+    }
+    tree_ = Parser::ParseTree(stack.back());
+  }
+
+  void Optimize() {
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      if (auto replacement = OptimizeNode(node.operator->())) {
+        tree_.Replace(node, std::move(replacement));
+      }
+    }
+  }
+
+  // Same result as Optimize. Subtrees below threshold nodes are optimized by
+  // the pool in batches of about threshold nodes; the few nodes above them
+  // follow on the calling thread.
+  // Folded numbers go to the shared token store, so threads need no parser.
+  void Optimize(ForkJoinPool &pool, size_t threshold = kParallelThreshold) {
+    auto parts = tree_.Split(threshold);
+    Vector<size_t> tasks;
+    Vector<size_t> batches;
+    Parser::ParseTree::CollectTasks(parts, tasks, batches);
+
+    Vector<Parser::ParseTree::Node::Ptr> results(tasks.size());
+    pool.Run(batches.size() - 1, [&](size_t batch, size_t) {
+      for (size_t task = batches[batch]; task < batches[batch + 1]; ++task) {
+        auto subtree = Parser::ParseTree(parts[tasks[task]].node_);
+        for (auto &&node = subtree.begin(); node != subtree.end(); ++node) {
+          if (auto replacement = OptimizeNode(node.operator->())) {
+            subtree.Replace(node, std::move(replacement));
+          }
+        }
+        results[task] = subtree.GetRoot();
+      }
+    });
+
+    for (size_t task = 0; task < tasks.size(); ++task) {
+      const auto &part = parts[tasks[task]];
+      if (tree_.IsRoot(part.node_)) {
+        tree_ = Parser::ParseTree(results[task]);
+        continue;
+      }
+      auto parent = part.node_->parent_.lock();
+      results[task]->parent_ = parent;
+      parent->children_[part.id_] = std::move(results[task]);
+    }
+
+    for (const auto &part : parts) {
+      if (part.is_task_) {
+        continue;
+      }
+      if (auto replacement = OptimizeNode(part.node_)) {
+        tree_.Replace(part.node_, std::move(replacement), part.id_);
+      }
+    }
+  }
+
+  // Replaces the formula with the cheapest equivalent form by EGraph::Cost
+  // that equality saturation finds within the limits. Unlike Optimize it
+  // reorders, factors and merges terms, see EGraph for the assumptions.
+  void Simplify(size_t max_iterations = EGraph::kMaxIterations,
+                size_t max_nodes = EGraph::kMaxNodes) {
+    if (tree_.GetRoot() == nullptr) {
+      return;
+    }
+
+    EGraph graph;
+    Vector<std::optional<Parser::TokenRef>> variables;
+    Vector<size_t> stack;
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      auto token = node->value_;
+      EGraph::ENode enode{token.Type(), 0, Number(), {0, 0}};
+      if (token.Type() == Parser::BaseTokenTypes::NUMBER) {
+        enode.number_ = token.GetNumber();
+      } else if (token.Type() == Parser::BaseTokenTypes::VARIABLE) {
+        enode.symbol_id_ = token.GetSymbolId();
+        if (token.GetSymbolId() >= variables.size()) {
+          variables.resize(token.GetSymbolId() + 1);
+        }
+        variables[token.GetSymbolId()] = node->value_;
+      }
+      // Flattened sums and products enter as chains of binary nodes.
+      size_t operands_number = node->children_.size();
+      for (; operands_number > 2; --operands_number) {
+        size_t right = stack.back();
+        stack.pop_back();
+        size_t left = stack.back();
+        stack.pop_back();
+        stack.push_back(graph.Add({token.Type(), 0, Number(), {left, right}}));
+      }
+      for (size_t i = operands_number; i > 0; --i) {
+        enode.children_[i - 1] = stack.back();
+        stack.pop_back();
+      }
+      stack.push_back(graph.Add(enode));
+    }
+
+    graph.Saturate(max_iterations, max_nodes);
+
+    Vector<Parser::ParseTree::Node::Ptr> nodes;
+    for (const auto &enode : graph.Extract(stack.back())) {
+      Parser::TokenRef token;
+      if (enode.type_ == Parser::BaseTokenTypes::NUMBER) {
+        token = parser_.AddNumber(enode.number_);
+      } else if (enode.type_ == Parser::BaseTokenTypes::VARIABLE) {
+        token = variables[enode.symbol_id_].value();
+      } else {
+        token = parser_.GetOperator(enode.type_).value();
+      }
+
+      auto node = std::make_shared<Parser::ParseTree::Node>(token);
+      size_t operands_number = EGraph::OperandsNumber(enode.type_);
+      for (size_t j = nodes.size() - operands_number; j < nodes.size(); ++j) {
+        Parser::ParseTree::Node::Attach(node, nodes[j]);
+      }
+      nodes.resize(nodes.size() - operands_number);
+      nodes.push_back(std::move(node));
+    }
+    tree_ = Parser::ParseTree(nodes.back());
+  }
+
+  // Evaluation cost of the tree by EGraph::Cost; a flattened node costs as
+  // much as the chain of binary ones it replaces.
+  size_t Cost() const {
+    size_t cost = 0;
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      size_t operations =
+          node->children_.size() > 2 ? node->children_.size() - 1 : 1;
+      cost += operations * EGraph::Cost(node->value_.Type());
+    }
+    return cost;
+  }
+
+ private:
+  explicit Formula(Parser::ParseTree tree) : tree_(std::move(tree)) {}
+
+  Formula At(const Vector<std::optional<Parser::TokenRef>> &values) const {
+    auto tree = Parser::ParseTree::CreateLike(
+        tree_,
+        [&values](const Parser::ParseTree::PostOrderIterator &formula_iter,
+                  Parser::ParseTree::PostOrderIterator &mapped_formula_iter) {
+          mapped_formula_iter->value_ = formula_iter->value_;
+
+          if (formula_iter->value_.Type() ==
+              Parser::BaseTokenTypes::VARIABLE) {
+            size_t id = formula_iter->value_.GetSymbolId();
+            if (id < values.size() && values[id]) {
+              mapped_formula_iter->value_ = values[id].value();
+            }
+          }
+        });
+
+    auto result = Formula(std::move(tree));
+    result.Optimize();
+    return result;
+  }
+
+  static bool IsFlattenable(int type) {
+    return type == Parser::BaseTokenTypes::PLUS ||
+           type == Parser::BaseTokenTypes::MULT;
+  }
+
+  static Parser::ParseTree::Node::Ptr NewNumber(Number number) {
+    return std::make_shared<Parser::ParseTree::Node>(
+        Parser::AddNumber(std::move(number)));
+  }
+
+  // One Optimize step, the children of node are already optimized. Returns
+  // the node to replace it with, or null if it stays.
+  static Parser::ParseTree::Node::Ptr OptimizeNode(
+      const Parser::ParseTree::Node::Ptr &node) {
+    if (node->children_.size() > 2) {
+      return OptimizeOperands(node);
+    }
+
+    if (node->children_.size() == 2) {
+      const auto &left = node->children_[0];
+      const auto &right = node->children_[1];
+      if (left->value_.Type() == Parser::BaseTokenTypes::NUMBER &&
+          right->value_.Type() == Parser::BaseTokenTypes::NUMBER) {
+        return NewNumber(HandleNumbers(left->value_.GetNumber(),
+                                       right->value_.GetNumber(),
+                                       node->value_.Type()));
+      }
+    }
+
+    if (node->children_.size() == 1) {
+      const auto &arg = node->children_[0];
+      if (arg->value_.Type() == Parser::BaseTokenTypes::NUMBER) {
+        return NewNumber(
+            HandleNumbers(arg->value_.GetNumber(), node->value_.Type()));
+      }
+    }
+
+    switch (node->value_.Type()) {
+      case Parser::BaseTokenTypes::PLUS: {
+        const auto &left = node->children_[0];
+        const auto &right = node->children_[1];
+
+        if (IsNumber(left, 0)) {
+          return right;
+        }
+
+        if (IsNumber(right, 0)) {
+          return left;
+        }
+      } break;
+
+      case Parser::BaseTokenTypes::MINUS: {
+        const auto &left = node->children_[0];
+        const auto &right = node->children_[1];
+
+        if (IsNumber(right, 0)) {
+          return left;
+        }
+      } break;
+
+      case Parser::BaseTokenTypes::MULT: {
+        const auto &left = node->children_[0];
+        const auto &right = node->children_[1];
+
+        if (IsNumber(left, 1)) {
+          return right;
+        }
+
+        if (IsNumber(right, 1)) {
+          return left;
+        }
+
+        if (IsNumber(left, 0)) {
+          return left;
+        }
+
+        if (IsNumber(right, 0)) {
+          return right;
+        }
+      } break;
 
       case Parser::BaseTokenTypes::DIV: {
-        const auto &left = cur_iter->children_[0]->value_;
-        const auto &right = cur_iter->children_[1]->value_;
-
-        current.diff_ =
-            DIV(Braced(MINUS(MULT(Braced(left.diff_), Braced(right.normal_)),
-                             MULT(Braced(right.diff_), Braced(left.normal_)))),
-                POW(Braced(right.normal_), "2"));
-        current.normal_ = DIV(Braced(left.normal_), Braced(right.normal_));
+        const auto &left = node->children_[0];
+        const auto &right = node->children_[1];
+
+        if (IsNumber(left, 0)) {
+          return left;
+        }
+
+        if (IsNumber(right, 1)) {
+          return left;
+        }
       } break;
 
       case Parser::BaseTokenTypes::POW: {
-        // (f ^ g)' = f ^ (g - 1) * (g * f' + f * log(f) * g')
+        const auto &left = node->children_[0];
+        const auto &right = node->children_[1];
+
+        if (IsNumber(left, 0)) {
+          return left;
+        }
+
+        if (IsNumber(left, 1)) {
+          return left;
+        }
+
+        if (IsNumber(right, 1)) {
+          return left;
+        }
+
+        if (IsNumber(right, 0)) {
+          return NewNumber(Number(1, 1));
+        }
+      } break;
+
+      default: {
+      }
+    }
+    return nullptr;
+  }
 
-        const auto &left = cur_iter->children_[0]->value_;
-        const auto &right = cur_iter->children_[1]->value_;
+  // Folds the number operands of a flattened sum or product into one, kept
+  // where the first of them was, and drops the neutral ones.
+  static Parser::ParseTree::Node::Ptr OptimizeOperands(
+      const Parser::ParseTree::Node::Ptr &node) {
+    int type = node->value_.Type();
+    std::optional<Number> folded;
+    for (const auto &operand : node->children_) {
+      if (operand->value_.Type() == Parser::BaseTokenTypes::NUMBER) {
+        const auto &number = operand->value_.GetNumber();
+        folded = folded ? HandleNumbers(folded.value(), number, type) : number;
+      }
+    }
+
+    int64_t neutral = type == Parser::BaseTokenTypes::PLUS ? 0 : 1;
+    if (folded && type == Parser::BaseTokenTypes::MULT &&
+        folded->GetValue() == 0) {
+      return NewNumber(folded.value());
+    }
+
+    Vector<Parser::ParseTree::Node::Ptr> operands;
+    for (const auto &operand : node->children_) {
+      if (operand->value_.Type() != Parser::BaseTokenTypes::NUMBER) {
+        operands.push_back(operand);
+      } else if (folded) {
+        if (folded->GetValue() != neutral) {
+          operands.push_back(NewNumber(folded.value()));
+          operands.back()->parent_ = node;
+        }
+        folded.reset();
+      }
+    }
+
+    if (operands.empty()) {
+      return NewNumber(Number(neutral, 1));
+    }
+    if (operands.size() == 1) {
+      return operands[0];
+    }
+    node->children_ = std::move(operands);
+    return nullptr;
+  }
+
+  // Independent partial results, one per lane, so consecutive operations do
+  // not wait for each other and the loop vectorizes where T allows it.
+  template <class T, class Operation>
+  static T Reduce(const T *operands, size_t operands_number,
+                  Operation operation) {
+    if (operands_number < 2 * kReductionLanes) {
+      T result = operands[0];
+      for (size_t i = 1; i < operands_number; ++i) {
+        result = operation(result, operands[i]);
+      }
+      return result;
+    }
 
-        current.diff_ = MULT(
+    T lanes[kReductionLanes];
+    std::copy(operands, operands + kReductionLanes, lanes);
+    size_t i = kReductionLanes;
+    for (; i + kReductionLanes <= operands_number; i += kReductionLanes) {
+      for (size_t lane = 0; lane < kReductionLanes; ++lane) {
+        lanes[lane] = operation(lanes[lane], operands[i + lane]);
+      }
+    }
+    for (; i < operands_number; ++i) {
+      lanes[0] = operation(lanes[0], operands[i]);
+    }
+    for (size_t lane = 1; lane < kReductionLanes; ++lane) {
+      lanes[0] = operation(lanes[0], lanes[lane]);
+    }
+    return lanes[0];
+  }
+
+  // Adds neighbours level by level in place.
+  static long double PairwiseSum(long double *operands,
+                                 size_t operands_number) {
+    for (size_t width = operands_number; width > 1; width = (width + 1) / 2) {
+      for (size_t i = 0; i < width / 2; ++i) {
+        operands[i] = operands[2 * i] + operands[2 * i + 1];
+      }
+      if (width % 2 == 1) {
+        operands[width / 2] = operands[width - 1];
+      }
+    }
+    return operands[0];
+  }
+
+  // Neumaier's variant of Kahan summation: the rounding error of every
+  // addition is accumulated separately, also when the new operand is the
+  // larger one.
+  static long double KahanSum(const long double *operands,
+                              size_t operands_number) {
+    long double sum = 0;
+    long double compensation = 0;
+    for (size_t i = 0; i < operands_number; ++i) {
+      long double next = sum + operands[i];
+      if (std::fabs(sum) >= std::fabs(operands[i])) {
+        compensation += (sum - next) + operands[i];
+      } else {
+        compensation += (operands[i] - next) + sum;
+      }
+      sum = next;
+    }
+    return sum + compensation;
+  }
+
+  static Number HandleNumbers(const Number &left, const Number &right,
+                              int operation) {
+    switch (operation) {
+      case Parser::BaseTokenTypes::PLUS: {
+        return left + right;
+      }
+      case Parser::BaseTokenTypes::MINUS: {
+        return left - right;
+      }
+      case Parser::BaseTokenTypes::MULT: {
+        return left * right;
+      }
+      case Parser::BaseTokenTypes::DIV: {
+        return left / right;
+      }
+      case Parser::BaseTokenTypes::POW: {
+        return Number::Pow(left, right);
+      }
+      default: {
+        return Number();
+      }
+    }
+  }
+
+  static Number HandleNumbers(const Number &arg, int operation) {
+    switch (operation) {
+      case Parser::BaseTokenTypes::LOG: {
+        return Number::Log(arg);
+      }
+      case Parser::BaseTokenTypes::SIN: {
+        return Number::Sin(arg);
+      }
+      case Parser::BaseTokenTypes::COS: {
+        return Number::Cos(arg);
+      }
+      default: {
+        return Number();
+      }
+    }
+  }
+
+  static Interval Calculate(const Interval &left, const Interval &right,
+                            int operation) {
+    switch (operation) {
+      case Parser::BaseTokenTypes::PLUS: {
+        return left + right;
+      }
+      case Parser::BaseTokenTypes::MINUS: {
+        return left - right;
+      }
+      case Parser::BaseTokenTypes::MULT: {
+        return left * right;
+      }
+      case Parser::BaseTokenTypes::DIV: {
+        return left / right;
+      }
+      case Parser::BaseTokenTypes::POW: {
+        return Interval::Pow(left, right);
+      }
+      default: {
+        return Interval::Entire();
+      }
+    }
+  }
+
+  static Interval Calculate(const Interval &arg, int operation) {
+    switch (operation) {
+      case Parser::BaseTokenTypes::LOG: {
+        return Interval::Log(arg);
+      }
+      case Parser::BaseTokenTypes::SIN: {
+        return Interval::Sin(arg);
+      }
+      case Parser::BaseTokenTypes::COS: {
+        return Interval::Cos(arg);
+      }
+      default: {
+        return Interval::Entire();
+      }
+    }
+  }
+
+  static size_t Priority(Parser::TokenRef token) {
+    if (token.Type() == Parser::BaseTokenTypes::NUMBER &&
+        token.GetNumber().GetValue() < 0) {
+      return kPlusPriority;
+    }
+    size_t priority = token.Info().priority_;
+    return priority == 0 ? kLeafPriority : priority;
+  }
+
+  // The parser is left-associative, so a later operand of the same priority
+  // keeps its brackets unless the operation is associative; powers always keep
+  // them to stay readable.
+  static bool NeedsBraces(Parser::TokenRef parent, Parser::TokenRef child,
+                          size_t id) {
+    if (parent.Info().is_function_) {
+      return false;
+    }
+
+    size_t priority = Priority(child);
+    if (priority != parent.Info().priority_) {
+      return priority < parent.Info().priority_;
+    }
+
+    return parent.Type() == Parser::BaseTokenTypes::POW ||
+           (id > 0 && parent.Type() != Parser::BaseTokenTypes::PLUS &&
+            parent.Type() != Parser::BaseTokenTypes::MULT);
+  }
+
+  // \\frac and the exponent's group bracket their operands themselves.
+  static bool NeedsLaTeXBraces(Parser::TokenRef parent, Parser::TokenRef child,
+                               size_t id) {
+    if (parent.Type() == Parser::BaseTokenTypes::DIV ||
+        (parent.Type() == Parser::BaseTokenTypes::POW && id == 1)) {
+      return false;
+    }
+    return NeedsBraces(parent, child, id);
+  }
+
+  // Declares one local per distinct subtree; returns the stack of locals
+  // left by the post-order walk.
+  Vector<size_t> EmitCBody(std::ostream &out) const {
+    UnorderedMap<String, size_t> locals;
+    Vector<size_t> stack;
+    for (auto &&node = tree_.begin(); node != tree_.end(); ++node) {
+      auto token = node->value_;
+      std::stringstream key;
+      std::stringstream expr;
+      expr << std::hexfloat;
+      switch (token.Type()) {
+        case Parser::BaseTokenTypes::NUMBER: {
+          EmitCNumber(expr, token.GetNumber().GetValue());
+          key << expr.str();
+        } break;
+
+        case Parser::BaseTokenTypes::VARIABLE: {
+          expr << "values[" << std::dec << token.GetSymbolId() << "]";
+          key << expr.str();
+        } break;
+
+        default: {
+          size_t operands_number = node->children_.size();
+          key << token.Type();
+          for (size_t i = stack.size() - operands_number; i < stack.size();
+               ++i) {
+            key << ' ' << stack[i];
+          }
+          EmitCOperation(expr, token.Type(), stack.end() - operands_number,
+                         operands_number);
+          stack.resize(stack.size() - operands_number);
+        }
+      }
+
+      auto local = locals.find(key.str());
+      if (local != locals.end()) {
+        stack.push_back(local->second);
+        continue;
+      }
+
+      size_t index = locals.size();
+      locals.insert({key.str(), index});
+      stack.push_back(index);
+      out << "  const double t" << index << " = " << expr.str() << ";\n";
+    }
+
+    return stack;
+  }
+
+  // Hexadecimal literals keep the double value exact.
+  static void EmitCNumber(std::ostream &out, long double value) {
+    if (std::isnan(value)) {
+      out << "NAN";
+    } else if (std::isinf(value)) {
+      out << (value < 0 ? "-INFINITY" : "INFINITY");
+    } else {
+      out << '(' << static_cast<double>(value) << ')';
+    }
+  }
+
+  static void EmitCOperation(std::ostream &out, int type,
+                             const size_t *operands, size_t operands_number) {
+    out << std::dec;
+    switch (type) {
+      case Parser::BaseTokenTypes::PLUS:
+      case Parser::BaseTokenTypes::MULT: {
+        out << 't' << operands[0];
+        for (size_t i = 1; i < operands_number; ++i) {
+          out << (type == Parser::BaseTokenTypes::PLUS ? " + t" : " * t")
+              << operands[i];
+        }
+      } break;
+      case Parser::BaseTokenTypes::MINUS: {
+        out << 't' << operands[0] << " - t" << operands[1];
+      } break;
+      case Parser::BaseTokenTypes::DIV: {
+        out << 't' << operands[0] << " / t" << operands[1];
+      } break;
+      case Parser::BaseTokenTypes::POW: {
+        out << "pow(t" << operands[0] << ", t" << operands[1] << ')';
+      } break;
+      case Parser::BaseTokenTypes::LOG: {
+        out << "log(t" << operands[0] << ')';
+      } break;
+      case Parser::BaseTokenTypes::SIN: {
+        out << "sin(t" << operands[0] << ')';
+      } break;
+      case Parser::BaseTokenTypes::COS: {
+        out << "cos(t" << operands[0] << ')';
+      } break;
+      default: {
+        out << "NAN";
+      }
+    }
+  }
+
+  // Bounds-checked cursor over serialized data.
+  struct BinaryReader {
+    const char *data_;
+    size_t size_;
+    size_t position_ = 0;
+
+    template <class T>
+    bool Read(T *value) {
+      return Read(value, sizeof(T));
+    }
+
+    bool Read(void *value, size_t size) {
+      if (size_ - position_ < size) {
+        return false;
+      }
+      std::memcpy(value, data_ + position_, size);
+      position_ += size;
+      return true;
+    }
+
+    bool Read(String *value, size_t size) {
+      if (size_ - position_ < size) {
+        return false;
+      }
+      value->assign(data_ + position_, size);
+      position_ += size;
+      return true;
+    }
+
+    // Skips size bytes equal to expected.
+    bool Skip(const String &expected, size_t size) {
+      if (size_ - position_ < size ||
+          expected.compare(0, String::npos, data_ + position_, size) != 0) {
+        return false;
+      }
+      position_ += size;
+      return true;
+    }
+
+    bool AtEnd() const { return position_ == size_; }
+  };
+
+  template <class T>
+  static void WriteRaw(std::ostream &out, const T &value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  // Writes into a unique file next to filename and renames it over filename,
+  // so readers never see a partially written result. mkstemp creates the
+  // file as 0600; it gets the mode a plain open would have given it.
+  static bool WriteAtomically(const String &filename, const String &data) {
+    String tmp_filename = filename + ".XXXXXX";
+    int fd = mkstemp(tmp_filename.data());
+    if (fd == -1) {
+      return false;
+    }
+    if (fchmod(fd, 0666 & ~ProcessUmask()) != 0) {
+      close(fd);
+      std::remove(tmp_filename.c_str());
+      return false;
+    }
+
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t result =
+          write(fd, data.data() + written, data.size() - written);
+      if (result <= 0) {
+        break;
+      }
+      written += result;
+    }
+
+    if (close(fd) != 0 || written != data.size() ||
+        std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+      std::remove(tmp_filename.c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+  // Linux reports the umask in /proc, elsewhere it can only be read by
+  // setting it, which briefly affects files other threads create.
+  static mode_t ProcessUmask() {
+    std::ifstream status("/proc/self/status");
+    String line;
+    while (std::getline(status, line)) {
+      if (line.compare(0, 6, "Umask:") == 0) {
+        return std::strtoul(line.c_str() + 6, nullptr, 8);
+      }
+    }
+
+    mode_t mask = umask(0);
+    umask(mask);
+    return mask;
+  }
+
+  static bool IsNumber(const Parser::ParseTree::Node::Ptr &node,
+                       long double value) {
+    return node->value_.Type() == Parser::BaseTokenTypes::NUMBER &&
+           node->value_.GetNumber().GetValue() == value;
+  }
+
+  static constexpr char kSerializationMagic[4] = {'D', 'F', 'R', 'M'};
+  // Version 1 had 32-bit opcodes, which wrapped indices of 2^24 and more.
+  static constexpr uint32_t kSerializationVersion = 2;
+  static const int kOpcodeTypeBits = 8;
+
+  static const size_t kReductionLanes = 4;
+
+  static const int kMaxTeXRuns = 5;
+  static const size_t kPlusPriority = 1;
+  static const size_t kLeafPriority = 5;
+  static const size_t kParallelThreshold = 4096;
+
+  static Parser parser_;
+  Parser::ParseTree tree_;
+
+  friend class LazyDerivative;
+  friend class SvgRenderer;
+};
+
+// Parser Formula::parser_ = Parser();
+
+class Differentiator {
+ public:
+  Differentiator() = default;
+
+  // Differentiates and optimizes subtrees of fewer than parallel_threshold
+  // nodes on pool, which must outlive the differentiator.
+  explicit Differentiator(ForkJoinPool *pool,
+                          size_t parallel_threshold = kParallelThreshold)
+      : pool_(pool), parallel_threshold_(parallel_threshold) {}
+
+  Formula Differentiate(const String &expr, const String &variable) {
+    return Differentiate(expr, variable, nullptr);
+  }
+
+  std::pair<Formula, Stats> DifferentiateWithStats(const String &expr,
+                                                   const String &variable) {
+    Stats stats;
+    auto result = Differentiate(expr, variable, &stats);
+    return {std::move(result), std::move(stats)};
+  }
+
+ private:
+  Formula Differentiate(const String &expr, const String &variable,
+                        Stats *stats) {
+    Stats::PhaseScope parsing(stats, "parse");
+    auto formula = Formula(expr);  // TODO: удалить эту строку
+    if (formula.GetTree().GetRoot() == nullptr) {
+      return formula;
+    }
+    formula.Flatten();
+    variable_id_ = Formula::FindVariable(variable);
+    parsing.Stop();
+
+    Stats::PhaseScope differentiation(stats, "differentiate");
+    tree_ = pool_ == nullptr ? ProcessTree(formula.GetTree())
+                             : ProcessTreeParallel(formula.GetTree());
+    differentiation.Stop();
+
+    Stats::PhaseScope reparsing(stats, "reparse");
+    auto result = Formula(tree_.GetRoot()->value_.diff_);
+    reparsing.Stop();
+    if (result.GetTree().GetRoot() == nullptr) {
+      return result;
+    }
+
+    if (stats != nullptr) {
+      stats->nodes_before_optimize_ = result.Size();
+    }
+
+    Stats::PhaseScope optimization(stats, "optimize");
+    if (pool_ == nullptr) {
+      result.Optimize();
+    } else {
+      result.Optimize(*pool_, parallel_threshold_);
+    }
+    optimization.Stop();
+
+    if (stats != nullptr) {
+      stats->nodes_after_optimize_ = result.Size();
+    }
+
+    return result;
+  }
+
+  struct NodeState {
+    VariableSet variables_;
+    String normal_;
+    String diff_;
+  };
+
+  Tree<NodeState> ProcessTree(const Parser::ParseTree &expr) {
+    return Tree<NodeState>::CreateLike(
+        expr, [this](const Parser::ParseTree::PostOrderIterator &expr_iter,
+                     Tree<NodeState>::PostOrderIterator &diff_iter) {
+          ProcessNode(*diff_iter, expr_iter->value_);
+        });
+  }
+
+  // The small subtrees found by Split are processed by the pool in the
+  // batches Split makes, the nodes above them are then joined in post-order
+  // on the calling thread.
+  Tree<NodeState> ProcessTreeParallel(const Parser::ParseTree &expr) {
+    auto parts = expr.Split(parallel_threshold_);
+    Vector<size_t> tasks;
+    Vector<size_t> batches;
+    Parser::ParseTree::CollectTasks(parts, tasks, batches);
+
+    Vector<Tree<NodeState>::Node::Ptr> results(tasks.size());
+    pool_->Run(batches.size() - 1, [&](size_t batch, size_t) {
+      for (size_t task = batches[batch]; task < batches[batch + 1]; ++task) {
+        auto subtree = Parser::ParseTree(parts[tasks[task]].node_);
+        results[task] = ProcessTree(subtree).GetRoot();
+      }
+    });
+
+    Vector<Tree<NodeState>::Node::Ptr> stack;
+    size_t task = 0;
+    for (const auto &part : parts) {
+      if (part.is_task_) {
+        stack.push_back(std::move(results[task++]));
+        continue;
+      }
+
+      auto node = std::make_shared<Tree<NodeState>::Node>();
+      size_t children_number = part.node_->children_.size();
+      for (size_t i = stack.size() - children_number; i < stack.size(); ++i) {
+        Tree<NodeState>::Node::Attach(node, std::move(stack[i]));
+      }
+      for (size_t i = 0; i < children_number; ++i) {
+        stack.pop_back();
+      }
+      ProcessNode(*node, part.node_->value_);
+      stack.push_back(std::move(node));
+    }
+
+    return Tree<NodeState>(stack.back());
+  }
+
+  bool DependsOnVariable(const NodeState &state) const {
+    return variable_id_ && state.variables_.Contains(*variable_id_);
+  }
+
+  void ProcessNode(Tree<NodeState>::Node &node, Parser::TokenRef token) {
+    auto &current = node.value_;
+
+    // The variables of a subtree are known before its derivative is built:
+    // post-order visits the children first.
+    if (token.Type() == Parser::BaseTokenTypes::VARIABLE) {
+      current.variables_.Insert(token.GetSymbolId());
+    }
+    for (const auto &child : node.children_) {
+      current.variables_.Merge(child->value_.variables_);
+    }
+
+    ProcessNormal(node, token);
+    // Subtrees without the variable differentiate to zero, so no rule terms
+    // are built for them.
+    current.diff_ = DependsOnVariable(current) ? ProcessDiff(node, token)
+                                               : ZERO;
+  }
+
+  void ProcessNormal(Tree<NodeState>::Node &node, Parser::TokenRef token) {
+    auto &current = node.value_;
+
+    switch (token.Type()) {
+      case Parser::BaseTokenTypes::PLUS: {
+        for (const auto &child : node.children_) {
+          if (!current.normal_.empty()) {
+            current.normal_ += token.Info().str_;
+          }
+          current.normal_ += child->value_.normal_;
+        }
+      } break;
+
+      case Parser::BaseTokenTypes::MULT: {
+        for (const auto &child : node.children_) {
+          if (!current.normal_.empty()) {
+            current.normal_ += token.Info().str_;
+          }
+          current.normal_ += Braced(child->value_.normal_);
+        }
+      } break;
+
+      case Parser::BaseTokenTypes::MINUS: {
+        const auto &left = node.children_[0]->value_;
+        const auto &right = node.children_[1]->value_;
+
+        current.normal_ =
+            left.normal_ + token.Info().str_ + Braced(right.normal_);
+      } break;
+
+      case Parser::BaseTokenTypes::DIV:
+      case Parser::BaseTokenTypes::POW: {
+        const auto &left = node.children_[0]->value_;
+        const auto &right = node.children_[1]->value_;
+
+        current.normal_ =
+            Braced(left.normal_) + token.Info().str_ + Braced(right.normal_);
+      } break;
+
+      case Parser::BaseTokenTypes::LOG:
+      case Parser::BaseTokenTypes::SIN:
+      case Parser::BaseTokenTypes::COS: {
+        current.normal_ = String(token.Info().str_) + "(" +
+                          node.children_[0]->value_.normal_ + ")";
+      } break;
+
+      default: {
+        // Numbers print in a form that reparses exactly.
+        current.normal_ = token.ToString();
+      }
+    }
+  }
+
+  // The derivative of a node that depends on the variable. Terms of the rules
+  // that hold the derivative of an independent child are left out.
+  String ProcessDiff(Tree<NodeState>::Node &node, Parser::TokenRef token) {
+    switch (token.Type()) {
+      case Parser::BaseTokenTypes::PLUS: {
+        String diff;
+        for (const auto &child : node.children_) {
+          if (DependsOnVariable(child->value_)) {
+            if (!diff.empty()) {
+              diff += token.Info().str_;
+            }
+            diff += child->value_.diff_;
+          }
+        }
+        return diff;
+      }
+
+      case Parser::BaseTokenTypes::MINUS: {
+        const auto &left = node.children_[0]->value_;
+        const auto &right = node.children_[1]->value_;
+
+        if (!DependsOnVariable(right)) {
+          return left.diff_;
+        }
+        return MINUS(left.diff_, right.diff_);
+      }
+
+      case Parser::BaseTokenTypes::MULT: {
+        if (node.children_.size() > 2) {
+          return ProcessProductDiff(node);
+        }
+
+        const auto &left = node.children_[0]->value_;
+        const auto &right = node.children_[1]->value_;
+
+        String left_term = MULT(Braced(left.diff_), Braced(right.normal_));
+        String right_term = MULT(Braced(right.diff_), Braced(left.normal_));
+        if (!DependsOnVariable(right)) {
+          return left_term;
+        }
+        if (!DependsOnVariable(left)) {
+          return right_term;
+        }
+        return PLUS(left_term, right_term);
+      }
+
+      case Parser::BaseTokenTypes::DIV: {
+        const auto &left = node.children_[0]->value_;
+        const auto &right = node.children_[1]->value_;
+
+        String numerator;
+        if (!DependsOnVariable(right)) {
+          numerator = MULT(Braced(left.diff_), Braced(right.normal_));
+        } else if (!DependsOnVariable(left)) {
+          numerator = MINUS(ZERO, MULT(Braced(right.diff_),
+                                       Braced(left.normal_)));
+        } else {
+          numerator = MINUS(MULT(Braced(left.diff_), Braced(right.normal_)),
+                            MULT(Braced(right.diff_), Braced(left.normal_)));
+        }
+        return DIV(Braced(numerator), POW(Braced(right.normal_), "2"));
+      }
+
+      case Parser::BaseTokenTypes::POW: {
+        const auto &left = node.children_[0]->value_;
+        const auto &right = node.children_[1]->value_;
+
+        // (f ^ c)' = c * f ^ (c - 1) * f'
+        if (!DependsOnVariable(right)) {
+          return MULT(MULT(Braced(right.normal_),
+                           POW(Braced(left.normal_),
+                               Braced(MINUS(right.normal_, "1")))),
+                      Braced(left.diff_));
+        }
+
+        // (c ^ g)' = c ^ g * log(c) * g'
+        if (!DependsOnVariable(left)) {
+          return MULT(MULT(POW(Braced(left.normal_), Braced(right.normal_)),
+                           LOG(left.normal_)),
+                      Braced(right.diff_));
+        }
+
+        // (f ^ g)' = f ^ (g - 1) * (g * f' + f * log(f) * g')
+        return MULT(
             POW(Braced(left.normal_), Braced(MINUS(right.normal_, "1"))),
             Braced(PLUS(MULT(Braced(right.normal_), Braced(left.diff_)),
                         MULT(Braced(left.normal_),
                              MULT(LOG(left.normal_), Braced(right.diff_))))));
-
-        current.normal_ = POW(Braced(left.normal_), Braced(right.normal_));
-      } break;
+      }
 
       case Parser::BaseTokenTypes::LOG: {
         // log(f)' = f' / f
 
-        const auto &arg = cur_iter->children_[0]->value_;
+        const auto &arg = node.children_[0]->value_;
 
-        current.diff_ = DIV(Braced(arg.diff_), Braced(arg.normal_));
-        current.normal_ = LOG(arg.normal_);
-      } break;
+        return DIV(Braced(arg.diff_), Braced(arg.normal_));
+      }
 
       case Parser::BaseTokenTypes::SIN: {
         // sin(f)' = f' * cos(f)
 
-        const auto &arg = cur_iter->children_[0]->value_;
+        const auto &arg = node.children_[0]->value_;
 
-        current.diff_ = MULT(Braced(arg.diff_), COS(arg.normal_));
-        current.normal_ = SIN(arg.normal_);
-      } break;
+        return MULT(Braced(arg.diff_), COS(arg.normal_));
+      }
 
       case Parser::BaseTokenTypes::COS: {
         // cos(f)' = 0 - f' * sin(f)
 
-        const auto &arg = cur_iter->children_[0]->value_;
+        const auto &arg = node.children_[0]->value_;
 
-        current.diff_ = MINUS(ZERO, MULT(Braced(arg.diff_), SIN(arg.normal_)));
-        current.normal_ = COS(arg.normal_);
-      } break;
-
-      case Parser::BaseTokenTypes::NUMBER: {
-        current.normal_ = expr_iter->value_->str_;
-        current.diff_ = "0";
-      } break;
+        return MINUS(ZERO, MULT(Braced(arg.diff_), SIN(arg.normal_)));
+      }
 
       case Parser::BaseTokenTypes::VARIABLE: {
-        if (expr_iter->value_->str_ == variable_) {
-          current.diff_ = "1";
-        } else {
-          current.diff_ = "0";
-        }
-        current.normal_ = expr_iter->value_->str_;
-      } break;
+        return "1";
+      }
 
       default: {
-        current.diff_ = "0";
-        current.normal_ = expr_iter->value_->str_;
+        return ZERO;
       }
     }
   }
 
+  // (f_1 * ... * f_k)' = f_1' * S_2 + f_1 * (f_2 * ... * f_k)' with the
+  // suffix products S_i = f_i * S_(i+1), unrolled from the last factor. The
+  // text embeds every S_i in full and its tree cannot share nodes, so the
+  // derivative is quadratic in k; only evaluators that merge equal subtrees,
+  // like Formula::EmitC, compute it in a linear number of operations.
+  // LazyDerivative shares the S_i and stays linear in size.
+  String ProcessProductDiff(Tree<NodeState>::Node &node) {
+    const auto &factors = node.children_;
+    const auto &last = factors.back()->value_;
+    String suffix = Braced(last.normal_);
+    String diff = DependsOnVariable(last) ? last.diff_ : String();
+    for (size_t i = factors.size() - 1; i > 0; --i) {
+      const auto &factor = factors[i - 1]->value_;
+      String term;
+      if (DependsOnVariable(factor)) {
+        term = MULT(Braced(factor.diff_), Braced(suffix));
+      }
+      if (!diff.empty()) {
+        String rest = MULT(Braced(factor.normal_), Braced(diff));
+        term = term.empty() ? rest : PLUS(term, rest);
+      }
+      diff = std::move(term);
+      suffix = MULT(Braced(factor.normal_), Braced(suffix));
+    }
+    return diff;
+  }
+
+  static const size_t kParallelThreshold = 4096;
+
+  ForkJoinPool *pool_ = nullptr;
+  size_t parallel_threshold_ = kParallelThreshold;
   Tree<NodeState> tree_;
-  String variable_;
+  std::optional<size_t> variable_id_;
 };
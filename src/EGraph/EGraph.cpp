@@ -0,0 +1 @@
+#include "EGraph.h"
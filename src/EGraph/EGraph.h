@@ -0,0 +1,617 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+
+#include "../Number/Number.h"
+#include "../Parser/Parser.h"
+#include "../String/String.h"
+#include "../UnorderedMap/UnorderedMap.h"
+#include "../Vector/Vector.h"
+
+// Equality saturation over formulas: an e-graph keeps classes of equivalent
+// terms, rewrite rules add equivalent forms to the classes until nothing
+// new appears or a limit is hit, and the cheapest term of the root class by
+// evaluation cost is extracted. The rules assume the formula is defined at
+// the point, as the derivative rules do: x / x is 1, and log(x * y) is
+// log(x) + log(y). Constants are folded only when the result is exact.
+class EGraph {
+ public:
+  // A term whose operands are classes. symbol_id_ is set for variables,
+  // number_ for numbers.
+  struct ENode {
+    int type_;
+    size_t symbol_id_ = 0;
+    Number number_;
+    size_t children_[2] = {0, 0};
+  };
+
+  static const size_t kMaxIterations = 8;
+  static const size_t kMaxNodes = 5000;
+
+  // children_ of the node must be classes of this graph.
+  size_t Add(ENode node) {
+    Canonicalize(node);
+    auto key = MakeKey(node);
+    auto memo_iter = memo_.find(key);
+    if (memo_iter != memo_.end()) {
+      return Find(memo_iter->second);
+    }
+
+    size_t id = parents_.size();
+    parents_.push_back(id);
+    classes_.push_back(Vector<size_t>{nodes_.size()});
+    constants_.push_back(Fold(node));
+    nodes_.push_back(node);
+    node_class_.push_back(id);
+    memo_.insert({key, id});
+
+    if (node.type_ != Parser::BaseTokenTypes::NUMBER && constants_[id]) {
+      Merge(id, Constant(constants_[id].value()));
+    }
+    return Find(id);
+  }
+
+  size_t Find(size_t id) {
+    size_t root = id;
+    while (parents_[root] != root) {
+      root = parents_[root];
+    }
+    while (parents_[id] != root) {
+      size_t next = parents_[id];
+      parents_[id] = root;
+      id = next;
+    }
+    return root;
+  }
+
+  // Applies every rule to every term until the graph stops changing; false
+  // when max_iterations or max_nodes ends it first.
+  bool Saturate(size_t max_iterations = kMaxIterations,
+                size_t max_nodes = kMaxNodes) {
+    for (size_t iteration = 0; iteration < max_iterations; ++iteration) {
+      size_t nodes_number = nodes_.size();
+      size_t merges = merges_;
+
+      Vector<size_t> live;
+      for (size_t id = 0; id < classes_.size(); ++id) {
+        if (parents_[id] == id) {
+          for (auto index : classes_[id]) {
+            live.push_back(index);
+          }
+        }
+      }
+      for (auto index : live) {
+        if (nodes_.size() >= max_nodes) {
+          break;
+        }
+        Rewrite(index);
+      }
+      Rebuild();
+
+      if (nodes_.size() == nodes_number && merges_ == merges) {
+        return true;
+      }
+      if (nodes_.size() >= max_nodes) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  // The cheapest term of the class in post-order, with children_ unset:
+  // every node is preceded by its operands, like Formula::Serialize.
+  Vector<ENode> Extract(size_t id) {
+    ComputeCosts();
+
+    Vector<ENode> result;
+    Vector<std::pair<size_t, bool>> stack;
+    stack.push_back({Find(id), false});
+    while (!stack.empty()) {
+      auto [current, expanded] = stack.back();
+      stack.pop_back();
+      const auto &node = nodes_[best_nodes_[current]];
+      if (expanded) {
+        result.push_back(node);
+        continue;
+      }
+
+      stack.push_back({current, true});
+      for (size_t i = OperandsNumber(node.type_); i > 0; --i) {
+        stack.push_back({Find(node.children_[i - 1]), false});
+      }
+    }
+    return result;
+  }
+
+  // Relative cost of evaluating one node of the type.
+  static size_t Cost(int type) {
+    switch (type) {
+      case Parser::BaseTokenTypes::PLUS:
+      case Parser::BaseTokenTypes::MINUS:
+      case Parser::BaseTokenTypes::MULT: {
+        return 2;
+      }
+      case Parser::BaseTokenTypes::DIV: {
+        return 8;
+      }
+      case Parser::BaseTokenTypes::POW: {
+        return 24;
+      }
+      case Parser::BaseTokenTypes::LOG:
+      case Parser::BaseTokenTypes::SIN:
+      case Parser::BaseTokenTypes::COS: {
+        return 20;
+      }
+      default: {
+        return 1;
+      }
+    }
+  }
+
+  static size_t OperandsNumber(int type) {
+    switch (type) {
+      case Parser::BaseTokenTypes::PLUS:
+      case Parser::BaseTokenTypes::MINUS:
+      case Parser::BaseTokenTypes::MULT:
+      case Parser::BaseTokenTypes::DIV:
+      case Parser::BaseTokenTypes::POW: {
+        return 2;
+      }
+      case Parser::BaseTokenTypes::LOG:
+      case Parser::BaseTokenTypes::SIN:
+      case Parser::BaseTokenTypes::COS: {
+        return 1;
+      }
+      default: {
+        return 0;
+      }
+    }
+  }
+
+  size_t NodesNumber() const { return nodes_.size(); }
+
+ private:
+  static const size_t kInfinity = SIZE_MAX;
+
+  size_t Constant(const Number &number) {
+    return Add({Parser::BaseTokenTypes::NUMBER, 0, number, {0, 0}});
+  }
+
+  size_t Constant(int64_t value) { return Constant(Number(value, 1)); }
+
+  size_t Make(int type, size_t left, size_t right = 0) {
+    return Add({type, 0, Number(), {left, right}});
+  }
+
+  bool IsConstant(size_t id, int64_t value) {
+    const auto &constant = constants_[Find(id)];
+    return constant && constant->IsInteger() &&
+           constant->GetExact()->numerator_ == value;
+  }
+
+  bool IsIntegerConstant(size_t id) {
+    const auto &constant = constants_[Find(id)];
+    return constant && constant->IsInteger();
+  }
+
+  // Copies, since adding terms may move the nodes.
+  Vector<ENode> NodesOf(size_t id, int type) {
+    Vector<ENode> result;
+    for (auto index : classes_[Find(id)]) {
+      if (nodes_[index].type_ == type) {
+        result.push_back(nodes_[index]);
+      }
+    }
+    return result;
+  }
+
+  bool Same(size_t left, size_t right) { return Find(left) == Find(right); }
+
+  void Rewrite(size_t index) {
+    using Types = Parser::BaseTokenTypes;
+
+    ENode node = nodes_[index];
+    size_t id = Find(node_class_[index]);
+    // A constant class is extracted as its number anyway, and rewriting it
+    // only grows the graph.
+    if (constants_[id]) {
+      return;
+    }
+    size_t a = Find(node.children_[0]);
+    size_t b = Find(node.children_[1]);
+
+    switch (node.type_) {
+      case Types::PLUS: {
+        Merge(id, Make(Types::PLUS, b, a));
+        if (IsConstant(a, 0)) {
+          Merge(id, b);
+        }
+        if (IsConstant(b, 0)) {
+          Merge(id, a);
+        }
+        if (Same(a, b)) {
+          Merge(id, Make(Types::MULT, Constant(2), a));
+        }
+        for (const auto &sum : NodesOf(a, Types::PLUS)) {
+          Merge(id, Make(Types::PLUS, sum.children_[0],
+                         Make(Types::PLUS, sum.children_[1], b)));
+        }
+        for (const auto &product : NodesOf(b, Types::MULT)) {
+          // a + u * a = a * (1 + u)
+          if (Same(product.children_[1], a)) {
+            Merge(id,
+                  Make(Types::MULT, a,
+                       Make(Types::PLUS, Constant(1), product.children_[0])));
+          }
+          // x * y + x * v = x * (y + v)
+          for (const auto &left : NodesOf(a, Types::MULT)) {
+            if (Same(left.children_[0], product.children_[0])) {
+              Merge(id, Make(Types::MULT, left.children_[0],
+                             Make(Types::PLUS, left.children_[1],
+                                  product.children_[1])));
+            }
+          }
+        }
+        for (const auto &left : NodesOf(a, Types::LOG)) {
+          for (const auto &right : NodesOf(b, Types::LOG)) {
+            Merge(id, Make(Types::LOG, Make(Types::MULT, left.children_[0],
+                                            right.children_[0])));
+          }
+        }
+      } break;
+
+      case Types::MINUS: {
+        if (IsConstant(b, 0)) {
+          Merge(id, a);
+        }
+        if (Same(a, b)) {
+          Merge(id, Constant(0));
+        }
+        for (const auto &sum : NodesOf(a, Types::PLUS)) {
+          if (Same(sum.children_[1], b)) {
+            Merge(id, sum.children_[0]);
+          }
+          if (Same(sum.children_[0], b)) {
+            Merge(id, sum.children_[1]);
+          }
+        }
+        for (const auto &left : NodesOf(a, Types::MULT)) {
+          for (const auto &right : NodesOf(b, Types::MULT)) {
+            if (Same(left.children_[0], right.children_[0])) {
+              Merge(id, Make(Types::MULT, left.children_[0],
+                             Make(Types::MINUS, left.children_[1],
+                                  right.children_[1])));
+            }
+          }
+        }
+        for (const auto &left : NodesOf(a, Types::LOG)) {
+          for (const auto &right : NodesOf(b, Types::LOG)) {
+            Merge(id, Make(Types::LOG, Make(Types::DIV, left.children_[0],
+                                            right.children_[0])));
+          }
+        }
+      } break;
+
+      case Types::MULT: {
+        Merge(id, Make(Types::MULT, b, a));
+        if (IsConstant(a, 1)) {
+          Merge(id, b);
+        }
+        if (IsConstant(a, 0)) {
+          Merge(id, a);
+        }
+        if (IsConstant(b, 1)) {
+          Merge(id, a);
+        }
+        if (IsConstant(b, 0)) {
+          Merge(id, b);
+        }
+        if (Same(a, b)) {
+          Merge(id, Make(Types::POW, a, Constant(2)));
+        }
+        for (const auto &product : NodesOf(a, Types::MULT)) {
+          Merge(id, Make(Types::MULT, product.children_[0],
+                         Make(Types::MULT, product.children_[1], b)));
+        }
+        for (const auto &power : NodesOf(a, Types::POW)) {
+          // x ^ y * x = x ^ (y + 1)
+          if (Same(power.children_[0], b)) {
+            Merge(id, Make(Types::POW, b,
+                           Make(Types::PLUS, power.children_[1],
+                                Constant(1))));
+          }
+          // x ^ y * x ^ v = x ^ (y + v)
+          for (const auto &right : NodesOf(b, Types::POW)) {
+            if (Same(power.children_[0], right.children_[0])) {
+              Merge(id, Make(Types::POW, power.children_[0],
+                             Make(Types::PLUS, power.children_[1],
+                                  right.children_[1])));
+            }
+          }
+        }
+        for (int type : {Types::PLUS, Types::MINUS}) {
+          for (const auto &sum : NodesOf(b, type)) {
+            Merge(id, Make(type, Make(Types::MULT, a, sum.children_[0]),
+                           Make(Types::MULT, a, sum.children_[1])));
+          }
+        }
+        for (const auto &quotient : NodesOf(b, Types::DIV)) {
+          Merge(id, Make(Types::DIV,
+                         Make(Types::MULT, a, quotient.children_[0]),
+                         quotient.children_[1]));
+        }
+        // y * log(x) = log(x ^ y)
+        for (const auto &log : NodesOf(b, Types::LOG)) {
+          Merge(id,
+                Make(Types::LOG, Make(Types::POW, log.children_[0], a)));
+        }
+      } break;
+
+      case Types::DIV: {
+        if (IsConstant(b, 1) || IsConstant(a, 0)) {
+          Merge(id, a);
+        }
+        if (Same(a, b)) {
+          Merge(id, Constant(1));
+        }
+        for (const auto &product : NodesOf(a, Types::MULT)) {
+          if (Same(product.children_[1], b)) {
+            Merge(id, product.children_[0]);
+          }
+        }
+        for (const auto &power : NodesOf(a, Types::POW)) {
+          if (Same(power.children_[0], b)) {
+            Merge(id, Make(Types::POW, b,
+                           Make(Types::MINUS, power.children_[1],
+                                Constant(1))));
+          }
+        }
+      } break;
+
+      case Types::POW: {
+        if (IsConstant(b, 1) || IsConstant(a, 0) || IsConstant(a, 1)) {
+          Merge(id, a);
+        }
+        if (IsConstant(b, 0)) {
+          Merge(id, Constant(1));
+        }
+        if (IsConstant(b, 2)) {
+          Merge(id, Make(Types::MULT, a, a));
+        }
+        // (x ^ y) ^ n = x ^ (y * n) for integers n only.
+        if (IsIntegerConstant(b)) {
+          for (const auto &power : NodesOf(a, Types::POW)) {
+            Merge(id, Make(Types::POW, power.children_[0],
+                           Make(Types::MULT, power.children_[1], b)));
+          }
+        }
+      } break;
+
+      case Types::LOG: {
+        for (const auto &product : NodesOf(a, Types::MULT)) {
+          Merge(id, Make(Types::PLUS, Make(Types::LOG, product.children_[0]),
+                         Make(Types::LOG, product.children_[1])));
+        }
+        for (const auto &quotient : NodesOf(a, Types::DIV)) {
+          Merge(id,
+                Make(Types::MINUS, Make(Types::LOG, quotient.children_[0]),
+                     Make(Types::LOG, quotient.children_[1])));
+        }
+        for (const auto &power : NodesOf(a, Types::POW)) {
+          Merge(id, Make(Types::MULT, power.children_[1],
+                         Make(Types::LOG, power.children_[0])));
+        }
+      } break;
+
+      default: {
+      }
+    }
+  }
+
+  bool Merge(size_t left, size_t right) {
+    left = Find(left);
+    right = Find(right);
+    if (left == right) {
+      return false;
+    }
+    if (classes_[left].size() < classes_[right].size()) {
+      std::swap(left, right);
+    }
+
+    parents_[right] = left;
+    for (auto index : classes_[right]) {
+      classes_[left].push_back(index);
+    }
+    classes_[right] = Vector<size_t>();
+    if (!constants_[left]) {
+      constants_[left] = constants_[right];
+    }
+    ++merges_;
+    return true;
+  }
+
+  // Restores the invariants broken by merges: equal terms share a class
+  // and each class lists a term once. Terms whose operands became constant
+  // are folded.
+  void Rebuild() {
+    bool changed = true;
+    while (changed) {
+      memo_ = UnorderedMap<String, size_t>();
+      Vector<std::pair<size_t, size_t>> congruent;
+      Vector<size_t> folded;
+
+      for (size_t id = 0; id < classes_.size(); ++id) {
+        if (parents_[id] != id) {
+          continue;
+        }
+        Vector<size_t> unique;
+        for (auto index : classes_[id]) {
+          Canonicalize(nodes_[index]);
+          auto key = MakeKey(nodes_[index]);
+          auto memo_iter = memo_.find(key);
+          if (memo_iter != memo_.end() && memo_iter->second == id) {
+            continue;
+          }
+          if (memo_iter == memo_.end()) {
+            memo_.insert({key, id});
+          } else {
+            congruent.push_back({memo_iter->second, id});
+          }
+          unique.push_back(index);
+          node_class_[index] = id;
+          if (!constants_[id] && Fold(nodes_[index])) {
+            folded.push_back(index);
+          }
+        }
+        classes_[id] = std::move(unique);
+      }
+
+      changed = !congruent.empty();
+      for (const auto &[left, right] : congruent) {
+        Merge(left, right);
+      }
+      for (auto index : folded) {
+        size_t id = Find(node_class_[index]);
+        if (!constants_[id]) {
+          auto constant = Fold(nodes_[index]);
+          constants_[id] = constant;
+          Merge(id, Constant(constant.value()));
+          changed = true;
+        }
+      }
+    }
+  }
+
+  // Least evaluation cost of every class, relaxed until it settles.
+  void ComputeCosts() {
+    costs_ = Vector<size_t>(classes_.size());
+    best_nodes_ = Vector<size_t>(classes_.size());
+    for (auto &cost : costs_) {
+      cost = kInfinity;
+    }
+
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (size_t id = 0; id < classes_.size(); ++id) {
+        if (parents_[id] != id) {
+          continue;
+        }
+        for (auto index : classes_[id]) {
+          const auto &node = nodes_[index];
+          size_t cost = Cost(node.type_);
+          for (size_t i = 0; i < OperandsNumber(node.type_); ++i) {
+            size_t child_cost = costs_[Find(node.children_[i])];
+            cost = child_cost == kInfinity || cost + child_cost < cost
+                       ? kInfinity
+                       : cost + child_cost;
+          }
+          if (cost < costs_[id]) {
+            costs_[id] = cost;
+            best_nodes_[id] = index;
+            changed = true;
+          }
+        }
+      }
+    }
+  }
+
+  void Canonicalize(ENode &node) {
+    for (size_t i = 0; i < OperandsNumber(node.type_); ++i) {
+      node.children_[i] = Find(node.children_[i]);
+    }
+  }
+
+  // The exact value of the term when its operands are constants.
+  std::optional<Number> Fold(const ENode &node) {
+    using Types = Parser::BaseTokenTypes;
+
+    if (node.type_ == Types::NUMBER) {
+      return node.number_;
+    }
+    size_t operands_number = OperandsNumber(node.type_);
+    if (operands_number == 0) {
+      return {};
+    }
+    for (size_t i = 0; i < operands_number; ++i) {
+      if (!constants_[Find(node.children_[i])]) {
+        return {};
+      }
+    }
+
+    const auto &left = constants_[Find(node.children_[0])].value();
+    Number result;
+    switch (node.type_) {
+      case Types::PLUS: {
+        result = left + constants_[Find(node.children_[1])].value();
+      } break;
+      case Types::MINUS: {
+        result = left - constants_[Find(node.children_[1])].value();
+      } break;
+      case Types::MULT: {
+        result = left * constants_[Find(node.children_[1])].value();
+      } break;
+      case Types::DIV: {
+        result = left / constants_[Find(node.children_[1])].value();
+      } break;
+      case Types::POW: {
+        result =
+            Number::Pow(left, constants_[Find(node.children_[1])].value());
+      } break;
+      case Types::LOG: {
+        result = Number::Log(left);
+      } break;
+      case Types::SIN: {
+        result = Number::Sin(left);
+      } break;
+      case Types::COS: {
+        result = Number::Cos(left);
+      } break;
+      default: {
+        return {};
+      }
+    }
+    if (!result.GetExact()) {
+      return {};
+    }
+    return result;
+  }
+
+  static String MakeKey(const ENode &node) {
+    String key;
+    key += std::to_string(node.type_);
+    if (node.type_ == Parser::BaseTokenTypes::NUMBER) {
+      const auto &exact = node.number_.GetExact();
+      if (exact) {
+        key += ":" + std::to_string(exact->numerator_) + "/" +
+               std::to_string(exact->denominator_);
+      } else {
+        char value[64];
+        std::snprintf(value, sizeof(value), "~%La", node.number_.GetValue());
+        key += value;
+      }
+    } else if (node.type_ == Parser::BaseTokenTypes::VARIABLE) {
+      key += "$" + std::to_string(node.symbol_id_);
+    } else {
+      for (size_t i = 0; i < OperandsNumber(node.type_); ++i) {
+        key += "," + std::to_string(node.children_[i]);
+      }
+    }
+    return key;
+  }
+
+  Vector<ENode> nodes_;
+  // The class each node was last seen in, up to Find.
+  Vector<size_t> node_class_;
+  // Union-find over classes.
+  Vector<size_t> parents_;
+  // Nodes of every root class.
+  Vector<Vector<size_t>> classes_;
+  Vector<std::optional<Number>> constants_;
+  UnorderedMap<String, size_t> memo_;
+  Vector<size_t> costs_;
+  Vector<size_t> best_nodes_;
+  size_t merges_ = 0;
+};
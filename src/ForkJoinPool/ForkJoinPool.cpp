@@ -0,0 +1 @@
+#include "ForkJoinPool.h"
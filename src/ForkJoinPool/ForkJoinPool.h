@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "../Vector/Vector.h"
+
+// Runs batches of independent tasks on a fixed set of threads. Every thread
+// owns a queue of task ids: it takes work from the back of its own queue and,
+// once that is empty, steals from the front of the others. The thread calling
+// Run works as the last thread, so a pool of one thread runs inline.
+class ForkJoinPool {
+ public:
+  explicit ForkJoinPool(
+      size_t threads_number = std::thread::hardware_concurrency()) {
+    threads_number = std::max<size_t>(threads_number, 1);
+    for (size_t i = 0; i < threads_number; ++i) {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i + 1 < threads_number; ++i) {
+      workers_.push_back(std::thread([this, i] { Work(i); }));
+    }
+  }
+
+  ForkJoinPool(const ForkJoinPool &) = delete;
+  ForkJoinPool &operator=(const ForkJoinPool &) = delete;
+
+  ~ForkJoinPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    has_tasks_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  size_t ThreadsNumber() const { return queues_.size(); }
+
+  // Calls task(id, thread) for every id below tasks_number and returns when
+  // all of them are done. thread is below ThreadsNumber() and no two calls
+  // with the same thread overlap, so it may index per-thread state. Must not
+  // be called from inside a task.
+  void Run(size_t tasks_number,
+           const std::function<void(size_t, size_t)> &task) {
+    if (tasks_number == 0) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    // A worker late for the previous batch may pop the new tasks as soon as
+    // they are queued, so the task is published first.
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+    }
+    remaining_ = tasks_number;
+    for (size_t i = 0; i < queues_.size(); ++i) {
+      std::lock_guard<std::mutex> lock(queues_[i]->mutex_);
+      queues_[i]->tasks_.resize(0);
+      queues_[i]->front_ = 0;
+      for (size_t id = i; id < tasks_number; id += queues_.size()) {
+        queues_[i]->tasks_.push_back(id);
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++generation_;
+    }
+    has_tasks_.notify_all();
+
+    RunTasks(queues_.size() - 1);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return remaining_ == 0; });
+    task_ = nullptr;
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex_;
+    Vector<size_t> tasks_;
+    size_t front_ = 0;
+  };
+
+  void Work(size_t thread) {
+    size_t generation = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        has_tasks_.wait(lock, [this, generation] {
+          return stopped_ || generation_ != generation;
+        });
+        if (stopped_) {
+          return;
+        }
+        generation = generation_;
+      }
+
+      RunTasks(thread);
+    }
+  }
+
+  void RunTasks(size_t thread) {
+    size_t id = 0;
+    while (Pop(thread, id) || Steal(thread, id)) {
+      (*task_)(id, thread);
+      if (--remaining_ == 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_.notify_all();
+      }
+    }
+  }
+
+  bool Pop(size_t thread, size_t &id) {
+    auto &queue = *queues_[thread];
+    std::lock_guard<std::mutex> lock(queue.mutex_);
+    if (queue.front_ == queue.tasks_.size()) {
+      return false;
+    }
+
+    id = queue.tasks_.back();
+    queue.tasks_.pop_back();
+    return true;
+  }
+
+  bool Steal(size_t thread, size_t &id) {
+    for (size_t i = 1; i < queues_.size(); ++i) {
+      auto &queue = *queues_[(thread + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex_);
+      if (queue.front_ < queue.tasks_.size()) {
+        id = queue.tasks_[queue.front_++];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  Vector<std::unique_ptr<Queue>> queues_;
+  Vector<std::thread> workers_;
+  const std::function<void(size_t, size_t)> *task_ = nullptr;
+  std::atomic<size_t> remaining_ = 0;
+  size_t generation_ = 0;
+  bool stopped_ = false;
+  std::mutex mutex_;
+  std::mutex run_mutex_;
+  std::condition_variable has_tasks_;
+  std::condition_variable done_;
+};
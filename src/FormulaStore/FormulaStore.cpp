@@ -0,0 +1 @@
+#include "FormulaStore.h"
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+
+#include "../DerivativeCache/DerivativeCache.h"
+#include "../Differenctiator/Differentiator.h"
+#include "../String/String.h"
+
+// Derivatives kept on disk in the binary format of Formula::Serialize, one
+// file per expression and variable named by the hash of the key. The key is
+// stored in the file as its label, so hash collisions read as misses.
+class FormulaStore {
+ public:
+  explicit FormulaStore(String directory) : directory_(std::move(directory)) {}
+
+  // Loads the stored derivative or computes and stores it.
+  Formula Differentiate(const String &expr, const String &variable) {
+    auto key = DerivativeCache::MakeKey(expr, variable);
+    auto filename = GetFilename(key);
+    if (auto formula = Formula::Load(filename, key)) {
+      ++hits_;
+      return std::move(formula.value());
+    }
+
+    ++misses_;
+    auto formula = differentiator_.Differentiate(expr, variable);
+    if (!formula.Save(filename, key)) {
+      ++failed_saves_;
+    }
+    return formula;
+  }
+
+  std::optional<Formula> Load(const String &expr,
+                              const String &variable) const {
+    auto key = DerivativeCache::MakeKey(expr, variable);
+    return Formula::Load(GetFilename(key), key);
+  }
+
+  bool Save(const String &expr, const String &variable,
+            const Formula &formula) const {
+    auto key = DerivativeCache::MakeKey(expr, variable);
+    return formula.Save(GetFilename(key), key);
+  }
+
+  size_t Hits() const { return hits_; }
+
+  size_t Misses() const { return misses_; }
+
+  size_t FailedSaves() const { return failed_saves_; }
+
+  // FNV-1a, which is stable across runs and builds unlike std::hash.
+  static uint64_t Hash(const String &key) {
+    uint64_t hash = kFNVOffsetBasis;
+    for (char symbol : key) {
+      hash ^= static_cast<unsigned char>(symbol);
+      hash *= kFNVPrime;
+    }
+    return hash;
+  }
+
+ private:
+  String GetFilename(const String &key) const {
+    char name[sizeof("0123456789abcdef.dfrm")];
+    std::snprintf(name, sizeof(name), "%016llx.dfrm",
+                  static_cast<unsigned long long>(Hash(key)));
+    return directory_ + "/" + name;
+  }
+
+  static const uint64_t kFNVOffsetBasis = 14695981039346656037ull;
+  static const uint64_t kFNVPrime = 1099511628211ull;
+
+  String directory_;
+  Differentiator differentiator_;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+  size_t failed_saves_ = 0;
+};
@@ -0,0 +1 @@
+#include "IncrementalFormula.h"
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "../Differenctiator/Differentiator.h"
+#include "../Vector/Vector.h"
+
+// Evaluates a formula at a point that changes a few variables at a time.
+// The value of every node is kept; setting a variable marks the paths from
+// its leaves to the root, and only those nodes are recomputed, children
+// first, when the value is read.
+class IncrementalFormula {
+ public:
+  // values are indexed by variable ids, like in Formula::Evaluate; missing
+  // variables are NaN until set.
+  explicit IncrementalFormula(const Formula &formula,
+                              const Vector<long double> &values = {}) {
+    Vector<size_t> stack;
+    const auto &tree = formula.GetTree();
+    for (auto &&node = tree.begin(); node != tree.end(); ++node) {
+      auto token = node->value_;
+      switch (token.Type()) {
+        case Parser::BaseTokenTypes::NUMBER: {
+          stack.push_back(AddNode(Node{token.Type()},
+                                  token.GetNumber().GetValue()));
+        } break;
+
+        case Parser::BaseTokenTypes::VARIABLE: {
+          size_t index = AddNode(Node{token.Type()},
+                                 token.GetSymbolId() < values.size()
+                                     ? values[token.GetSymbolId()]
+                                     : NAN);
+          if (token.GetSymbolId() >= leaves_.size()) {
+            leaves_.resize(token.GetSymbolId() + 1);
+          }
+          leaves_[token.GetSymbolId()].push_back(index);
+          stack.push_back(index);
+        } break;
+
+        default: {
+          if (node->children_.size() == 1) {
+            stack.back() = AddOperation(token.Type(), stack.back(), kNoNode);
+            break;
+          }
+
+          // Flattened sums and products are split into a balanced tree of
+          // binary nodes, so a change recomputes a logarithmic number of
+          // their partial results.
+          Vector<size_t> operands;
+          for (size_t i = stack.size() - node->children_.size();
+               i < stack.size(); ++i) {
+            operands.push_back(stack[i]);
+          }
+          for (size_t i = 0; i < node->children_.size(); ++i) {
+            stack.pop_back();
+          }
+          while (operands.size() > 1) {
+            size_t paired = 0;
+            for (size_t i = 0; i + 1 < operands.size(); i += 2) {
+              operands[paired++] =
+                  AddOperation(token.Type(), operands[i], operands[i + 1]);
+            }
+            if (operands.size() % 2 == 1) {
+              operands[paired++] = operands.back();
+            }
+            while (operands.size() > paired) {
+              operands.pop_back();
+            }
+          }
+          stack.push_back(operands[0]);
+        }
+      }
+    }
+  }
+
+  // Variables the formula does not use are ignored.
+  void Set(size_t id, long double value) {
+    if (id >= leaves_.size()) {
+      return;
+    }
+    for (auto leaf : leaves_[id]) {
+      values_[leaf] = value;
+      MarkDirty(nodes_[leaf].parent_);
+    }
+  }
+
+  void Set(const String &name, long double value) {
+    if (auto id = Formula::FindVariable(name)) {
+      Set(id.value(), value);
+    }
+  }
+
+  long double Value() {
+    if (values_.empty()) {
+      return NAN;
+    }
+
+    // Post-order indices put children before their parents.
+    std::sort(dirty_nodes_.begin(), dirty_nodes_.end());
+    for (auto index : dirty_nodes_) {
+      values_[index] = Calculate(nodes_[index]);
+      dirty_[index] = false;
+    }
+    recomputed_ += dirty_nodes_.size();
+    // Keeps the capacity, unlike resize.
+    while (!dirty_nodes_.empty()) {
+      dirty_nodes_.pop_back();
+    }
+
+    return values_.back();
+  }
+
+  // Nodes recomputed by Value since construction.
+  size_t Recomputed() const { return recomputed_; }
+
+  size_t Size() const { return nodes_.size(); }
+
+ private:
+  static const size_t kNoNode = SIZE_MAX;
+
+  struct Node {
+    int type_;
+    size_t left_ = kNoNode;
+    size_t right_ = kNoNode;
+    size_t parent_ = kNoNode;
+  };
+
+  // Nodes are added children first, so indices stay in post-order.
+  size_t AddNode(Node node, long double value) {
+    nodes_.push_back(node);
+    values_.push_back(value);
+    dirty_.push_back(false);
+    return nodes_.size() - 1;
+  }
+
+  size_t AddOperation(int type, size_t left, size_t right) {
+    Node node{type, left, right};
+    size_t index = AddNode(node, Calculate(node));
+    nodes_[left].parent_ = index;
+    if (right != kNoNode) {
+      nodes_[right].parent_ = index;
+    }
+    return index;
+  }
+
+  long double Calculate(const Node &node) const {
+    if (node.right_ == kNoNode) {
+      return Formula::Calculate(values_[node.left_], node.type_);
+    }
+    return Formula::Calculate(values_[node.left_], values_[node.right_],
+                              node.type_);
+  }
+
+  // Stops at the first marked node: the rest of its path is marked already.
+  void MarkDirty(size_t index) {
+    while (index != kNoNode && !dirty_[index]) {
+      dirty_[index] = true;
+      dirty_nodes_.push_back(index);
+      index = nodes_[index].parent_;
+    }
+  }
+
+  Vector<Node> nodes_;
+  Vector<long double> values_;
+  Vector<bool> dirty_;
+  // Leaves of every variable, indexed by variable ids.
+  Vector<Vector<size_t>> leaves_;
+  Vector<size_t> dirty_nodes_;
+  size_t recomputed_ = 0;
+};
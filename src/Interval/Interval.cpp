@@ -0,0 +1 @@
+#include "Interval.h"
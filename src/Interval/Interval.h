@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "../Number/Number.h"
+
+// Closed range of long doubles that is guaranteed to contain the exact result
+// of every operation applied to points of the operands: bounds are rounded
+// outwards by an ulp after each arithmetic operation and by kLibmUlps after
+// library functions. Points where an operation is undefined (log of a
+// negative, a non-integer power of a negative) are left out; an operation
+// defined nowhere on its operands gives the empty interval, which propagates.
+class Interval {
+ public:
+  Interval() = default;
+
+  Interval(long double lower, long double upper)
+      : lower_(lower), upper_(upper) {}
+
+  explicit Interval(long double value) : lower_(value), upper_(value) {}
+
+  // Integers are exact in a long double, other constants are widened.
+  static Interval FromNumber(const Number &number) {
+    if (number.IsInteger()) {
+      return Interval(number.GetValue());
+    }
+    return Interval(Down(number.GetValue()), Up(number.GetValue()));
+  }
+
+  static Interval Entire() { return Interval(-kInfinity, kInfinity); }
+
+  static Interval Empty() { return Interval(NAN, NAN); }
+
+  long double GetLower() const { return lower_; }
+
+  long double GetUpper() const { return upper_; }
+
+  bool IsEmpty() const { return std::isnan(lower_) || std::isnan(upper_); }
+
+  bool Contains(long double value) const {
+    return !IsEmpty() && lower_ <= value && value <= upper_;
+  }
+
+  bool IsPoint() const { return !IsEmpty() && lower_ == upper_; }
+
+  friend Interval operator+(const Interval &left, const Interval &right) {
+    if (left.IsEmpty() || right.IsEmpty()) {
+      return Empty();
+    }
+    return Interval(Down(left.lower_ + right.lower_),
+                    Up(left.upper_ + right.upper_));
+  }
+
+  friend Interval operator-(const Interval &left, const Interval &right) {
+    if (left.IsEmpty() || right.IsEmpty()) {
+      return Empty();
+    }
+    return Interval(Down(left.lower_ - right.upper_),
+                    Up(left.upper_ - right.lower_));
+  }
+
+  friend Interval operator*(const Interval &left, const Interval &right) {
+    if (left.IsEmpty() || right.IsEmpty()) {
+      return Empty();
+    }
+    long double products[] = {Multiply(left.lower_, right.lower_),
+                              Multiply(left.lower_, right.upper_),
+                              Multiply(left.upper_, right.lower_),
+                              Multiply(left.upper_, right.upper_)};
+    return Interval(Down(*std::min_element(products, products + 4)),
+                    Up(*std::max_element(products, products + 4)));
+  }
+
+  // A divisor containing zero leaves the quotient unbounded.
+  friend Interval operator/(const Interval &left, const Interval &right) {
+    if (left.IsEmpty() || right.IsEmpty() ||
+        (right.lower_ == 0 && right.upper_ == 0)) {
+      return Empty();
+    }
+    if (right.Contains(0)) {
+      return Entire();
+    }
+    long double quotients[] = {
+        left.lower_ / right.lower_, left.lower_ / right.upper_,
+        left.upper_ / right.lower_, left.upper_ / right.upper_};
+    for (auto &quotient : quotients) {
+      if (std::isnan(quotient)) {
+        return Entire();
+      }
+    }
+    return Interval(Down(*std::min_element(quotients, quotients + 4)),
+                    Up(*std::max_element(quotients, quotients + 4)));
+  }
+
+  static Interval Pow(const Interval &base, const Interval &exponent) {
+    if (base.IsEmpty() || exponent.IsEmpty()) {
+      return Empty();
+    }
+
+    if (exponent.IsPoint() && std::trunc(exponent.lower_) == exponent.lower_ &&
+        std::abs(exponent.lower_) <= kMaxIntegerExponent) {
+      return IntegerPow(base, static_cast<int64_t>(exponent.lower_));
+    }
+
+    // Negative bases are defined for integer exponents only, and those are
+    // not bounded by the corners.
+    bool has_integer_exponent =
+        std::ceil(exponent.lower_) <= std::floor(exponent.upper_);
+    if (base.lower_ < 0 && (base.upper_ <= 0 || has_integer_exponent)) {
+      return Entire();
+    }
+
+    // For non-negative bases x^y is monotonic in x and in y separately, so the
+    // corners bound it.
+    long double lower = std::max<long double>(base.lower_, 0);
+    long double powers[] = {powl(lower, exponent.lower_),
+                            powl(lower, exponent.upper_),
+                            powl(base.upper_, exponent.lower_),
+                            powl(base.upper_, exponent.upper_)};
+    for (auto &power : powers) {
+      if (std::isnan(power)) {
+        return Entire();
+      }
+    }
+    return Interval(
+        std::max<long double>(
+            Down(*std::min_element(powers, powers + 4), kLibmUlps), 0),
+        Up(*std::max_element(powers, powers + 4), kLibmUlps));
+  }
+
+  static Interval Log(const Interval &arg) {
+    if (arg.IsEmpty() || arg.upper_ <= 0) {
+      return Empty();
+    }
+    return Interval(
+        arg.lower_ <= 0 ? -kInfinity : Down(std::log(arg.lower_), kLibmUlps),
+        Up(std::log(arg.upper_), kLibmUlps));
+  }
+
+  static Interval Sin(const Interval &arg) {
+    return Periodic(arg, kHalfPi, [](long double x) { return std::sin(x); });
+  }
+
+  static Interval Cos(const Interval &arg) {
+    return Periodic(arg, 0, [](long double x) { return std::cos(x); });
+  }
+
+ private:
+  // Bounds a 2pi-periodic function with its maxima at offset + 2pi k and its
+  // minima at offset + pi + 2pi k, such as sin and cos.
+  template <class Function>
+  static Interval Periodic(const Interval &arg, long double offset,
+                           Function function) {
+    if (arg.IsEmpty()) {
+      return Empty();
+    }
+    if (!std::isfinite(arg.lower_) || !std::isfinite(arg.upper_) ||
+        arg.upper_ - arg.lower_ >= 2 * kPi) {
+      return Interval(-1, 1);
+    }
+
+    long double first = function(arg.lower_);
+    long double second = function(arg.upper_);
+    long double lower = Down(std::min(first, second), kLibmUlps);
+    long double upper = Up(std::max(first, second), kLibmUlps);
+    if (ContainsExtremum(arg, offset)) {
+      upper = 1;
+    }
+    if (ContainsExtremum(arg, offset + kPi)) {
+      lower = -1;
+    }
+    return Interval(std::max<long double>(lower, -1),
+                    std::min<long double>(upper, 1));
+  }
+
+  // Whether some point + 2pi k may lie in arg; pi and the division are not
+  // exact, so points close to the bounds count as contained.
+  static bool ContainsExtremum(const Interval &arg, long double point) {
+    long double slack =
+        kSlack * (1 + std::abs(arg.lower_) + std::abs(arg.upper_));
+    long double first = std::ceil((arg.lower_ - point) / (2 * kPi) - slack);
+    long double last = std::floor((arg.upper_ - point) / (2 * kPi) + slack);
+    return first <= last;
+  }
+
+  static Interval IntegerPow(const Interval &base, int64_t exponent) {
+    if (exponent == 0) {
+      return Interval(1);
+    }
+    if (exponent < 0) {
+      return Interval(1) / IntegerPow(base, -exponent);
+    }
+
+    long double lower = powl(base.lower_, exponent);
+    long double upper = powl(base.upper_, exponent);
+    if (exponent % 2 == 1 || base.lower_ >= 0) {
+      return Interval(Down(lower, kLibmUlps), Up(upper, kLibmUlps));
+    }
+    if (base.upper_ <= 0) {
+      return Interval(Down(upper, kLibmUlps), Up(lower, kLibmUlps));
+    }
+    return Interval(0, Up(std::max(lower, upper), kLibmUlps));
+  }
+
+  // Infinite bounds meeting zero bounds stand for values approaching zero,
+  // so their product is zero.
+  static long double Multiply(long double left, long double right) {
+    if (left == 0 || right == 0) {
+      return 0;
+    }
+    return left * right;
+  }
+
+  static long double Down(long double value, int ulps = 1) {
+    for (int i = 0; i < ulps; ++i) {
+      value = std::nextafter(value, -kInfinity);
+    }
+    return value;
+  }
+
+  static long double Up(long double value, int ulps = 1) {
+    for (int i = 0; i < ulps; ++i) {
+      value = std::nextafter(value, kInfinity);
+    }
+    return value;
+  }
+
+  static constexpr long double kInfinity =
+      std::numeric_limits<long double>::infinity();
+  static constexpr long double kPi = 3.141592653589793238462643383279502884L;
+  static constexpr long double kHalfPi = kPi / 2;
+  static constexpr long double kSlack = 1e-16L;
+  static const int kLibmUlps = 4;
+  static const int64_t kMaxIntegerExponent = 1 << 20;
+
+  long double lower_ = 0;
+  long double upper_ = 0;
+};
@@ -0,0 +1 @@
+#include "JitFormula.h"
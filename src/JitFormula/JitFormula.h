@@ -0,0 +1,399 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "../Differenctiator/Differentiator.h"
+#include "../Vector/Vector.h"
+
+// A formula translated into x86-64 machine code in process, in microseconds.
+// The post-order tree becomes a stack machine over 16-byte frame slots: the
+// scalar entry point works on the low lanes with SSE2 scalar instructions,
+// the pair kernel evaluates two points at once with packed ones. log, sin,
+// cos and pow are called from libm lane by lane. Elsewhere, or if executable
+// memory is unavailable, the entry points run the tree evaluator.
+class JitFormula {
+ public:
+  // values are indexed by variable ids, like in Formula::Evaluate.
+  using Function = double (*)(const double *values);
+  using PairFunction = void (*)(const double *first, const double *second,
+                                double *results);
+
+  explicit JitFormula(Formula formula)
+      : formula_(std::move(formula)), values_number_(formula_.ValuesNumber()) {
+#if defined(__x86_64__)
+    Compile();
+#endif
+  }
+
+  JitFormula(const JitFormula &) = delete;
+  JitFormula &operator=(const JitFormula &) = delete;
+
+  ~JitFormula() {
+    if (code_ != nullptr) {
+      munmap(code_, code_size_);
+    }
+  }
+
+  bool IsCompiled() const { return function_ != nullptr; }
+
+  // Null when the formula is not compiled.
+  Function GetFunction() const { return function_; }
+
+  PairFunction GetPairFunction() const { return pair_function_; }
+
+  size_t ValuesNumber() const { return values_number_; }
+
+  double Evaluate(const double *values) const {
+    if (function_ != nullptr) {
+      return function_(values);
+    }
+    return formula_.Evaluate(
+        Vector<long double>(values, values + values_number_));
+  }
+
+  // Evaluates count points laid out stride values apart.
+  void Evaluate(const double *points, size_t count, size_t stride,
+                double *results) const {
+    size_t i = 0;
+    if (pair_function_ != nullptr) {
+      for (; i + 1 < count; i += 2) {
+        pair_function_(points + i * stride, points + (i + 1) * stride,
+                       results + i);
+      }
+    }
+    for (; i < count; ++i) {
+      results[i] = Evaluate(points + i * stride);
+    }
+  }
+
+  const Formula &GetFormula() const { return formula_; }
+
+ private:
+  // Encodes the few instructions the translation needs. Memory operands are
+  // always [base + disp32].
+  class Assembler {
+   public:
+    static const uint8_t kRax = 0;
+    static const uint8_t kRdx = 2;
+    static const uint8_t kRbx = 3;
+    static const uint8_t kRsp = 4;
+    static const uint8_t kRsi = 6;
+    static const uint8_t kRdi = 7;
+    static const uint8_t kR12 = 12;
+    static const uint8_t kR13 = 13;
+
+    // SSE2 opcodes after the 0x0F escape, shared by the sd and pd forms.
+    static const uint8_t kAdd = 0x58;
+    static const uint8_t kMul = 0x59;
+    static const uint8_t kSub = 0x5C;
+    static const uint8_t kDiv = 0x5E;
+
+    void Push(uint8_t reg) {
+      if (reg >= 8) {
+        Byte(0x41);
+      }
+      Byte(0x50 + (reg & 7));
+    }
+
+    void Pop(uint8_t reg) {
+      if (reg >= 8) {
+        Byte(0x41);
+      }
+      Byte(0x58 + (reg & 7));
+    }
+
+    // mov destination, source for 64-bit registers.
+    void MoveRegister(uint8_t destination, uint8_t source) {
+      Byte(0x48 | (source >= 8 ? 0x04 : 0) | (destination >= 8 ? 0x01 : 0));
+      Byte(0x89);
+      Byte(0xC0 | (source & 7) << 3 | (destination & 7));
+    }
+
+    void AddRsp(int32_t value) {
+      Byte(0x48);
+      Byte(0x81);
+      Byte(0xC4);
+      Int32(value);
+    }
+
+    void SubRsp(int32_t value) {
+      Byte(0x48);
+      Byte(0x81);
+      Byte(0xEC);
+      Int32(value);
+    }
+
+    void MoveImmediate(uint64_t value) {
+      Byte(0x48);
+      Byte(0xB8);
+      for (int i = 0; i < 8; ++i) {
+        Byte(value >> (8 * i));
+      }
+    }
+
+    // mov rax, [base + disp].
+    void Load(uint8_t base, int32_t disp) {
+      Byte(0x48 | (base >= 8 ? 0x01 : 0));
+      Byte(0x8B);
+      Memory(kRax, base, disp);
+    }
+
+    // mov [base + disp], rax.
+    void Store(uint8_t base, int32_t disp) {
+      Byte(0x48 | (base >= 8 ? 0x01 : 0));
+      Byte(0x89);
+      Memory(kRax, base, disp);
+    }
+
+    // movsd xmm, [base + disp] or movapd / movupd for packed values.
+    void LoadXmm(uint8_t xmm, uint8_t base, int32_t disp, bool packed) {
+      Sse(packed ? 0x66 : 0xF2, packed ? 0x28 : 0x10, xmm, base, disp);
+    }
+
+    void StoreXmm(uint8_t xmm, uint8_t base, int32_t disp, bool packed,
+                  bool aligned = true) {
+      Sse(packed ? 0x66 : 0xF2, packed ? (aligned ? 0x29 : 0x11) : 0x11, xmm,
+          base, disp);
+    }
+
+    // op xmm, [base + disp] for kAdd, kMul, kSub and kDiv.
+    void Arithmetic(uint8_t opcode, uint8_t xmm, uint8_t base, int32_t disp,
+                    bool packed) {
+      Sse(packed ? 0x66 : 0xF2, opcode, xmm, base, disp);
+    }
+
+    void CallRax() {
+      Byte(0xFF);
+      Byte(0xD0);
+    }
+
+    void Return() { Byte(0xC3); }
+
+    const Vector<uint8_t> &GetCode() const { return code_; }
+
+   private:
+    void Sse(uint8_t prefix, uint8_t opcode, uint8_t xmm, uint8_t base,
+             int32_t disp) {
+      Byte(prefix);
+      if (base >= 8) {
+        Byte(0x41);
+      }
+      Byte(0x0F);
+      Byte(opcode);
+      Memory(xmm, base, disp);
+    }
+
+    // ModRM with mod = 10; rsp and r12 as a base need a SIB byte.
+    void Memory(uint8_t reg, uint8_t base, int32_t disp) {
+      Byte(0x80 | (reg & 7) << 3 | (base & 7));
+      if ((base & 7) == kRsp) {
+        Byte(0x24);
+      }
+      Int32(disp);
+    }
+
+    void Int32(int32_t value) {
+      for (int i = 0; i < 4; ++i) {
+        Byte(static_cast<uint32_t>(value) >> (8 * i));
+      }
+    }
+
+    void Byte(uint8_t byte) { code_.push_back(byte); }
+
+    Vector<uint8_t> code_;
+  };
+
+  static const int32_t kSlotSize = 16;
+
+  void Compile() {
+    size_t depth = 0;
+    size_t max_depth = 1;
+    const auto &tree = formula_.GetTree();
+    if (tree.GetRoot() != nullptr) {
+      for (auto &&node = tree.begin(); node != tree.end(); ++node) {
+        depth = depth + 1 - node->children_.size();
+        max_depth = std::max(max_depth, depth);
+      }
+    }
+    // Three pushes after the return address keep rsp 16-byte aligned as long
+    // as the frame is a multiple of 16.
+    int32_t frame = max_depth * kSlotSize;
+
+    Assembler scalar;
+    Assembler pair;
+    Translate(scalar, frame, false);
+    Translate(pair, frame, true);
+
+    const auto &scalar_code = scalar.GetCode();
+    const auto &pair_code = pair.GetCode();
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size = scalar_code.size() + pair_code.size();
+    code_size_ = (size + page_size - 1) / page_size * page_size;
+    void *code = mmap(nullptr, code_size_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+      return;
+    }
+
+    auto *bytes = static_cast<uint8_t *>(code);
+    std::memcpy(bytes, scalar_code.begin(), scalar_code.size());
+    std::memcpy(bytes + scalar_code.size(), pair_code.begin(),
+                pair_code.size());
+    if (mprotect(code, code_size_, PROT_READ | PROT_EXEC) != 0) {
+      munmap(code, code_size_);
+      return;
+    }
+
+    code_ = code;
+    function_ = reinterpret_cast<Function>(bytes);
+    pair_function_ =
+        reinterpret_cast<PairFunction>(bytes + scalar_code.size());
+  }
+
+  // The scalar function reads values from rbx (rdi); the pair kernel reads
+  // the points from rbx (rdi) and r12 (rsi) and writes to r13 (rdx).
+  void Translate(Assembler &code, int32_t frame, bool packed) const {
+    using A = Assembler;
+    code.Push(A::kRbx);
+    code.Push(A::kR12);
+    code.Push(A::kR13);
+    code.SubRsp(frame);
+    code.MoveRegister(A::kRbx, A::kRdi);
+    code.MoveRegister(A::kR12, A::kRsi);
+    code.MoveRegister(A::kR13, A::kRdx);
+
+    int32_t depth = 0;
+    auto slot = [](int32_t index) { return index * kSlotSize; };
+    const auto &tree = formula_.GetTree();
+    if (tree.GetRoot() == nullptr) {
+      code.MoveImmediate(Bits(NAN));
+      code.Store(A::kRsp, 0);
+      code.Store(A::kRsp, 8);
+      depth = 1;
+    } else {
+      for (auto &&node = tree.begin(); node != tree.end(); ++node) {
+        TranslateNode(code, node->value_, node->children_.size(), depth,
+                      packed);
+      }
+    }
+
+    if (packed) {
+      code.LoadXmm(0, A::kRsp, slot(depth - 1), true);
+      code.StoreXmm(0, A::kR13, 0, true, false);
+    } else {
+      code.LoadXmm(0, A::kRsp, slot(depth - 1), false);
+    }
+    code.AddRsp(frame);
+    code.Pop(A::kR13);
+    code.Pop(A::kR12);
+    code.Pop(A::kRbx);
+    code.Return();
+  }
+
+  // Keeps the value stack in frame slots; depth is the number of live ones.
+  static void TranslateNode(Assembler &code, Parser::TokenRef token,
+                            size_t operands_number, int32_t &depth,
+                            bool packed) {
+    using A = Assembler;
+    auto slot = [](int32_t index) { return index * kSlotSize; };
+    switch (token.Type()) {
+      case Parser::BaseTokenTypes::NUMBER: {
+        code.MoveImmediate(Bits(token.GetNumber().GetValue()));
+        code.Store(A::kRsp, slot(depth));
+        code.Store(A::kRsp, slot(depth) + 8);
+        ++depth;
+      } break;
+
+      case Parser::BaseTokenTypes::VARIABLE: {
+        int32_t offset = token.GetSymbolId() * sizeof(double);
+        code.Load(A::kRbx, offset);
+        code.Store(A::kRsp, slot(depth));
+        if (packed) {
+          code.Load(A::kR12, offset);
+          code.Store(A::kRsp, slot(depth) + 8);
+        }
+        ++depth;
+      } break;
+
+      case Parser::BaseTokenTypes::PLUS:
+      case Parser::BaseTokenTypes::MINUS:
+      case Parser::BaseTokenTypes::MULT:
+      case Parser::BaseTokenTypes::DIV: {
+        // Flattened sums and products fold all their operands in xmm0.
+        depth -= static_cast<int32_t>(operands_number) - 1;
+        code.LoadXmm(0, A::kRsp, slot(depth - 1), packed);
+        for (size_t i = 1; i < operands_number; ++i) {
+          code.Arithmetic(ArithmeticOpcode(token.Type()), 0, A::kRsp,
+                          slot(depth - 1 + i), packed);
+        }
+        code.StoreXmm(0, A::kRsp, slot(depth - 1), packed);
+      } break;
+
+      default: {
+        if (operands_number == 2) {
+          --depth;
+        }
+        for (int32_t lane = 0; lane < (packed ? 2 : 1); ++lane) {
+          int32_t lane_offset = lane * sizeof(double);
+          code.LoadXmm(0, A::kRsp, slot(depth - 1) + lane_offset, false);
+          if (operands_number == 2) {
+            code.LoadXmm(1, A::kRsp, slot(depth) + lane_offset, false);
+          }
+          code.MoveImmediate(
+              reinterpret_cast<uint64_t>(LibmFunction(token.Type())));
+          code.CallRax();
+          code.StoreXmm(0, A::kRsp, slot(depth - 1) + lane_offset, false);
+        }
+      }
+    }
+  }
+
+  static uint8_t ArithmeticOpcode(int type) {
+    switch (type) {
+      case Parser::BaseTokenTypes::PLUS:
+        return Assembler::kAdd;
+      case Parser::BaseTokenTypes::MINUS:
+        return Assembler::kSub;
+      case Parser::BaseTokenTypes::MULT:
+        return Assembler::kMul;
+      default:
+        return Assembler::kDiv;
+    }
+  }
+
+  // The double overloads, so arguments and results stay in xmm0 and xmm1.
+  static void *LibmFunction(int type) {
+    switch (type) {
+      case Parser::BaseTokenTypes::POW:
+        return reinterpret_cast<void *>(
+            static_cast<double (*)(double, double)>(std::pow));
+      case Parser::BaseTokenTypes::LOG:
+        return reinterpret_cast<void *>(
+            static_cast<double (*)(double)>(std::log));
+      case Parser::BaseTokenTypes::SIN:
+        return reinterpret_cast<void *>(
+            static_cast<double (*)(double)>(std::sin));
+      default:
+        return reinterpret_cast<void *>(
+            static_cast<double (*)(double)>(std::cos));
+    }
+  }
+
+  static uint64_t Bits(long double value) {
+    double converted = value;
+    uint64_t bits;
+    std::memcpy(&bits, &converted, sizeof(bits));
+    return bits;
+  }
+
+  Formula formula_;
+  size_t values_number_;
+  void *code_ = nullptr;
+  size_t code_size_ = 0;
+  Function function_ = nullptr;
+  PairFunction pair_function_ = nullptr;
+};
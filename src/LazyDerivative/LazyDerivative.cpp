@@ -0,0 +1 @@
+#include "LazyDerivative.h"
@@ -0,0 +1,523 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <sstream>
+
+#include "../Differenctiator/Differentiator.h"
+#include "../Number/Number.h"
+#include "../Parser/Parser.h"
+#include "../String/String.h"
+#include "../UnorderedMap/UnorderedMap.h"
+#include "../Vector/Vector.h"
+
+// Derivative of a formula that is built only as far as it is looked at.
+// Every node stands either for a subtree of the formula or for its
+// derivative and is expanded by one rule, one level deep, when a traversal,
+// Print or Evaluate first reaches it; the expansion is kept for later ones.
+// Nodes form a DAG: the subtrees of the formula and their derivatives are
+// shared by every rule that uses them. The terms are not optimized, and the
+// formula must outlive the view.
+class LazyDerivative {
+ public:
+  static constexpr size_t kRoot = 0;
+
+  LazyDerivative(const Formula &formula, const String &variable)
+      : variable_id_(Formula::FindVariable(variable)) {
+    const auto &root = formula.GetTree().GetRoot();
+    if (root == nullptr || !DependsOnVariable(root.get())) {
+      AddNumber(0);
+    } else {
+      DerivativeOf(root.get());
+    }
+  }
+
+  Parser::TokenRef GetToken(size_t id) {
+    Materialize(id);
+    return nodes_[id].token_;
+  }
+
+  size_t ChildrenNumber(size_t id) {
+    Materialize(id);
+    return nodes_[id].children_.size();
+  }
+
+  // The child stays unexpanded until it is looked at itself.
+  size_t GetChild(size_t id, size_t child) {
+    Materialize(id);
+    return nodes_[id].children_[child];
+  }
+
+  // Nodes expanded so far.
+  size_t MaterializedNumber() const { return materialized_number_; }
+
+  // Prints the derivative like Formula::Print; shared nodes are printed at
+  // every use.
+  void Print(std::ostream &out) {
+    Materialize(kRoot);
+    Enter(out, kRoot, nullptr, 0);
+    // Nodes on the path from the root with the number of children entered.
+    Vector<std::pair<size_t, size_t>> stack;
+    stack.push_back({kRoot, 0});
+    while (!stack.empty()) {
+      auto [id, entered] = stack.back();
+      if (entered < nodes_[id].children_.size()) {
+        if (entered > 0) {
+          out << nodes_[id].token_.Info().str_;
+        }
+        ++stack.back().second;
+        size_t child = nodes_[id].children_[entered];
+        Materialize(child);
+        Enter(out, child, &nodes_[id].token_, entered);
+        stack.push_back({child, 0});
+        continue;
+      }
+
+      stack.pop_back();
+      if (stack.empty()) {
+        Leave(out, id, nullptr, 0);
+      } else {
+        Leave(out, id, &nodes_[stack.back().first].token_,
+              stack.back().second - 1);
+      }
+    }
+  }
+
+  String ToString() {
+    std::stringstream out;
+    Print(out);
+    return out.str();
+  }
+
+  long double Evaluate(const UnorderedMap<String, long double> &variables) {
+    Vector<long double> values(Formula::parser_.SymbolsNumber());
+    for (size_t id = 0; id < values.size(); ++id) {
+      auto var_iter = variables.find(Formula::parser_.GetSymbolName(id));
+      values[id] = var_iter != variables.end() ? var_iter->second : NAN;
+    }
+
+    return Evaluate(values);
+  }
+
+  // values are indexed by variable ids, see Formula::FindVariable. Every node
+  // is evaluated once, however many rules share it.
+  long double Evaluate(const Vector<long double> &values) {
+    ++evaluation_;
+    Vector<size_t> stack;
+    stack.push_back(kRoot);
+    while (!stack.empty()) {
+      size_t id = stack.back();
+      Materialize(id);
+      if (nodes_[id].evaluation_ == evaluation_) {
+        stack.pop_back();
+        continue;
+      }
+
+      bool is_ready = true;
+      for (size_t child : nodes_[id].children_) {
+        if (nodes_[child].evaluation_ != evaluation_) {
+          stack.push_back(child);
+          is_ready = false;
+        }
+      }
+      if (!is_ready) {
+        continue;
+      }
+
+      Vector<long double> operands;
+      for (size_t child : nodes_[id].children_) {
+        operands.push_back(nodes_[child].value_);
+      }
+      nodes_[id].value_ = Calculate(nodes_[id].token_, operands, values);
+      nodes_[id].evaluation_ = evaluation_;
+      stack.pop_back();
+    }
+
+    return nodes_[kRoot].value_;
+  }
+
+ private:
+  // Formula nodes are aligned in memory; the multiplication spreads the
+  // varying bits of their addresses over the power-of-two bucket counts of
+  // UnorderedMap.
+  struct SourceHash {
+    size_t operator()(const Parser::ParseTree::Node *node) const {
+      return (reinterpret_cast<uintptr_t>(node) * kHashMultiplier) >> 16;
+    }
+  };
+
+  template <class Value>
+  using SourceMap =
+      SimpleUnorderedMap<const Parser::ParseTree::Node *, Value, SourceHash>;
+
+  struct Node {
+    // Until the node is materialized, the formula subtree it copies or, for
+    // derivatives, differentiates.
+    const Parser::ParseTree::Node *source_ = nullptr;
+    bool is_derivative_ = false;
+    bool is_materialized_ = false;
+    Parser::TokenRef token_;
+    Vector<size_t> children_;
+    // Value in the last Evaluate that reached the node.
+    size_t evaluation_ = 0;
+    long double value_ = 0;
+  };
+
+  // Searches the subtree for the variable on first use. A hit marks the whole
+  // path to it; a miss marks only node, since nothing under a constant
+  // subtree is ever differentiated.
+  bool DependsOnVariable(const Parser::ParseTree::Node *node) {
+    auto memo_iter = dependent_.find(node);
+    if (memo_iter != dependent_.end()) {
+      return memo_iter->second;
+    }
+
+    // Nodes from node down to the current one with their next child.
+    Vector<std::pair<const Parser::ParseTree::Node *, size_t>> path;
+    path.push_back({node, 0});
+    while (!path.empty()) {
+      const auto *current = path.back().first;
+      size_t next = path.back().second;
+      if (next == 0) {
+        auto current_iter = dependent_.find(current);
+        bool is_known = current_iter != dependent_.end();
+        if ((is_known && current_iter->second) ||
+            (current->value_.Type() == Parser::BaseTokenTypes::VARIABLE &&
+             variable_id_ == current->value_.GetSymbolId())) {
+          for (const auto &[dependent, _] : path) {
+            dependent_.insert({dependent, true});
+          }
+          return true;
+        }
+        if (is_known) {
+          path.pop_back();
+          continue;
+        }
+      }
+
+      if (next < current->children_.size()) {
+        ++path.back().second;
+        path.push_back({current->children_[next].get(), 0});
+      } else {
+        path.pop_back();
+      }
+    }
+
+    dependent_.insert({node, false});
+    return false;
+  }
+
+  // Rules may expand a derivative to another derivative node, as for
+  // (f + c)' = f'; such chains are followed without recursion and every node
+  // on them takes the expansion of the last one.
+  void Materialize(size_t id) {
+    Vector<size_t> chain;
+    while (!nodes_[id].is_materialized_) {
+      size_t expansion = Expand(id);
+      if (expansion == id) {
+        break;
+      }
+      chain.push_back(id);
+      id = expansion;
+    }
+
+    for (size_t i = chain.size(); i > 0; --i) {
+      auto &node = nodes_[chain[i - 1]];
+      node.token_ = nodes_[id].token_;
+      node.children_ = nodes_[id].children_;
+      node.is_materialized_ = true;
+      ++materialized_number_;
+    }
+  }
+
+  // Materializes a copy in place and returns id; a derivative is returned as
+  // the node it equals.
+  size_t Expand(size_t id) {
+    const auto *source = nodes_[id].source_;
+    if (!nodes_[id].is_derivative_) {
+      Vector<size_t> children;
+      for (const auto &child : source->children_) {
+        children.push_back(CopyOf(child.get()));
+      }
+      nodes_[id].token_ = source->value_;
+      nodes_[id].children_ = std::move(children);
+      nodes_[id].is_materialized_ = true;
+      ++materialized_number_;
+      return id;
+    }
+
+    return Differentiate(*source);
+  }
+
+  // The same rules as Differentiator, on nodes instead of strings.
+  size_t Differentiate(const Parser::ParseTree::Node &node) {
+    const auto &children = node.children_;
+    switch (node.value_.Type()) {
+      case Parser::BaseTokenTypes::PLUS: {
+        Vector<size_t> terms;
+        for (const auto &child : children) {
+          if (DependsOnVariable(child.get())) {
+            terms.push_back(DerivativeOf(child.get()));
+          }
+        }
+        return terms.size() == 1 ? terms[0]
+                                 : AddOperation(node.value_.Type(),
+                                                std::move(terms));
+      }
+
+      case Parser::BaseTokenTypes::MINUS: {
+        const auto *left = children[0].get();
+        const auto *right = children[1].get();
+
+        if (!DependsOnVariable(right)) {
+          return DerivativeOf(left);
+        }
+        return AddOperation(Parser::BaseTokenTypes::MINUS,
+                            DependsOnVariable(left) ? DerivativeOf(left)
+                                                    : AddNumber(0),
+                            DerivativeOf(right));
+      }
+
+      case Parser::BaseTokenTypes::MULT: {
+        // (f_1 * ... * f_k)' = f_1' * S_2 + f_1 * (f_2 * ... * f_k)' with the
+        // suffix products S_i = f_i * S_(i+1) shared between the terms.
+        size_t suffix = CopyOf(children.back().get());
+        std::optional<size_t> diff;
+        if (DependsOnVariable(children.back().get())) {
+          diff = DerivativeOf(children.back().get());
+        }
+        for (size_t i = children.size() - 1; i > 0; --i) {
+          const auto *factor = children[i - 1].get();
+          std::optional<size_t> term;
+          if (DependsOnVariable(factor)) {
+            term = AddOperation(Parser::BaseTokenTypes::MULT,
+                                DerivativeOf(factor), suffix);
+          }
+          if (diff) {
+            size_t rest = AddOperation(Parser::BaseTokenTypes::MULT,
+                                       CopyOf(factor), diff.value());
+            term = term ? AddOperation(Parser::BaseTokenTypes::PLUS,
+                                       term.value(), rest)
+                        : rest;
+          }
+          diff = term;
+          suffix = AddOperation(Parser::BaseTokenTypes::MULT, CopyOf(factor),
+                                suffix);
+        }
+        return diff.value();
+      }
+
+      case Parser::BaseTokenTypes::DIV: {
+        const auto *left = children[0].get();
+        const auto *right = children[1].get();
+
+        std::optional<size_t> numerator;
+        if (DependsOnVariable(left)) {
+          numerator = AddOperation(Parser::BaseTokenTypes::MULT,
+                                   DerivativeOf(left), CopyOf(right));
+        }
+        if (DependsOnVariable(right)) {
+          numerator = AddOperation(
+              Parser::BaseTokenTypes::MINUS,
+              numerator ? numerator.value() : AddNumber(0),
+              AddOperation(Parser::BaseTokenTypes::MULT, DerivativeOf(right),
+                           CopyOf(left)));
+        }
+        return AddOperation(Parser::BaseTokenTypes::DIV, numerator.value(),
+                            AddOperation(Parser::BaseTokenTypes::POW,
+                                         CopyOf(right), AddNumber(2)));
+      }
+
+      case Parser::BaseTokenTypes::POW: {
+        const auto *left = children[0].get();
+        const auto *right = children[1].get();
+
+        // (f ^ c)' = c * f ^ (c - 1) * f'
+        if (!DependsOnVariable(right)) {
+          size_t power = AddOperation(
+              Parser::BaseTokenTypes::POW, CopyOf(left),
+              AddOperation(Parser::BaseTokenTypes::MINUS, CopyOf(right),
+                           AddNumber(1)));
+          return AddOperation(Parser::BaseTokenTypes::MULT,
+                              AddOperation(Parser::BaseTokenTypes::MULT,
+                                           CopyOf(right), power),
+                              DerivativeOf(left));
+        }
+
+        // (c ^ g)' = c ^ g * log(c) * g'
+        if (!DependsOnVariable(left)) {
+          return AddOperation(
+              Parser::BaseTokenTypes::MULT,
+              AddOperation(Parser::BaseTokenTypes::MULT, CopyOf(&node),
+                           AddFunction(Parser::BaseTokenTypes::LOG, left)),
+              DerivativeOf(right));
+        }
+
+        // (f ^ g)' = f ^ (g - 1) * (g * f' + f * log(f) * g')
+        size_t power = AddOperation(
+            Parser::BaseTokenTypes::POW, CopyOf(left),
+            AddOperation(Parser::BaseTokenTypes::MINUS, CopyOf(right),
+                         AddNumber(1)));
+        size_t sum = AddOperation(
+            Parser::BaseTokenTypes::PLUS,
+            AddOperation(Parser::BaseTokenTypes::MULT, CopyOf(right),
+                         DerivativeOf(left)),
+            AddOperation(
+                Parser::BaseTokenTypes::MULT, CopyOf(left),
+                AddOperation(Parser::BaseTokenTypes::MULT,
+                             AddFunction(Parser::BaseTokenTypes::LOG, left),
+                             DerivativeOf(right))));
+        return AddOperation(Parser::BaseTokenTypes::MULT, power, sum);
+      }
+
+      case Parser::BaseTokenTypes::LOG: {
+        // log(f)' = f' / f
+        const auto *arg = children[0].get();
+        return AddOperation(Parser::BaseTokenTypes::DIV, DerivativeOf(arg),
+                            CopyOf(arg));
+      }
+
+      case Parser::BaseTokenTypes::SIN: {
+        // sin(f)' = f' * cos(f)
+        const auto *arg = children[0].get();
+        return AddOperation(Parser::BaseTokenTypes::MULT, DerivativeOf(arg),
+                            AddFunction(Parser::BaseTokenTypes::COS, arg));
+      }
+
+      case Parser::BaseTokenTypes::COS: {
+        // cos(f)' = 0 - f' * sin(f)
+        const auto *arg = children[0].get();
+        return AddOperation(
+            Parser::BaseTokenTypes::MINUS, AddNumber(0),
+            AddOperation(Parser::BaseTokenTypes::MULT, DerivativeOf(arg),
+                         AddFunction(Parser::BaseTokenTypes::SIN, arg)));
+      }
+
+      default: {
+        // The variable is the only leaf with a derivative node.
+        return AddNumber(1);
+      }
+    }
+  }
+
+  size_t CopyOf(const Parser::ParseTree::Node *node) {
+    return AddSource(copies_, node, false);
+  }
+
+  size_t DerivativeOf(const Parser::ParseTree::Node *node) {
+    return AddSource(derivatives_, node, true);
+  }
+
+  size_t AddSource(SourceMap<size_t> &memo,
+                   const Parser::ParseTree::Node *node, bool is_derivative) {
+    auto memo_iter = memo.find(node);
+    if (memo_iter != memo.end()) {
+      return memo_iter->second;
+    }
+
+    nodes_.push_back({.source_ = node,
+                      .is_derivative_ = is_derivative,
+                      .token_ = {},
+                      .children_ = {}});
+    memo.insert({node, nodes_.size() - 1});
+    return nodes_.size() - 1;
+  }
+
+  size_t AddNumber(int64_t value) {
+    return AddNode(Formula::parser_.AddNumber(Number(value, 1)), {});
+  }
+
+  size_t AddFunction(int type, const Parser::ParseTree::Node *arg) {
+    Vector<size_t> children;
+    children.push_back(CopyOf(arg));
+    return AddOperation(type, std::move(children));
+  }
+
+  size_t AddOperation(int type, size_t left, size_t right) {
+    Vector<size_t> children;
+    children.push_back(left);
+    children.push_back(right);
+    return AddOperation(type, std::move(children));
+  }
+
+  size_t AddOperation(int type, Vector<size_t> children) {
+    return AddNode(Formula::parser_.GetOperator(type).value(),
+                   std::move(children));
+  }
+
+  size_t AddNode(Parser::TokenRef token, Vector<size_t> children) {
+    nodes_.push_back({.is_materialized_ = true,
+                      .token_ = token,
+                      .children_ = std::move(children)});
+    ++materialized_number_;
+    return nodes_.size() - 1;
+  }
+
+  static long double Calculate(Parser::TokenRef token,
+                               Vector<long double> &operands,
+                               const Vector<long double> &values) {
+    switch (token.Type()) {
+      case Parser::BaseTokenTypes::NUMBER: {
+        return token.GetNumber().GetValue();
+      }
+      case Parser::BaseTokenTypes::VARIABLE: {
+        return token.GetSymbolId() < values.size()
+                   ? values[token.GetSymbolId()]
+                   : NAN;
+      }
+      default: {
+        if (operands.size() == 1) {
+          return Formula::Calculate(operands[0], token.Type());
+        }
+        if (operands.size() == 2) {
+          return Formula::Calculate(operands[0], operands[1], token.Type());
+        }
+        return Formula::Reduce<long double>(operands.begin(), operands.size(),
+                                            token.Type());
+      }
+    }
+  }
+
+  static void Enter(std::ostream &out, Parser::TokenRef token,
+                    const Parser::TokenRef *parent, size_t id) {
+    if (parent != nullptr && Formula::NeedsBraces(*parent, token, id)) {
+      out << '(';
+    }
+    if (token.Info().is_function_) {
+      out << token.Info().str_ << '(';
+    } else if (token.Info().operands_number_ == 0) {
+      token.Print(out);
+    }
+  }
+
+  static void Leave(std::ostream &out, Parser::TokenRef token,
+                    const Parser::TokenRef *parent, size_t id) {
+    if (token.Info().is_function_) {
+      out << ')';
+    }
+    if (parent != nullptr && Formula::NeedsBraces(*parent, token, id)) {
+      out << ')';
+    }
+  }
+
+  void Enter(std::ostream &out, size_t id, const Parser::TokenRef *parent,
+             size_t position) {
+    Enter(out, nodes_[id].token_, parent, position);
+  }
+
+  void Leave(std::ostream &out, size_t id, const Parser::TokenRef *parent,
+             size_t position) {
+    Leave(out, nodes_[id].token_, parent, position);
+  }
+
+  static const uint64_t kHashMultiplier = 0x9e3779b97f4a7c15;
+
+  std::optional<size_t> variable_id_;
+  SourceMap<bool> dependent_;
+  SourceMap<size_t> copies_;
+  SourceMap<size_t> derivatives_;
+  Vector<Node> nodes_;
+  size_t materialized_number_ = 0;
+  size_t evaluation_ = 0;
+};
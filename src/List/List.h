@@ -46,6 +46,18 @@ class List {
     return std::move(result);
   }
 
+  // Unlinks the first item satisfying predicate, if any.
+  template <class Predicate>
+  bool RemoveFirst(Predicate predicate) {
+    for (auto *link = &head_; *link != nullptr; link = &(*link)->next_) {
+      if (predicate((*link)->GetItem())) {
+        *link = std::move((*link)->next_);
+        return true;
+      }
+    }
+    return false;
+  }
+
   bool IsEmpty() const noexcept { return head_ == nullptr; }
 
   List() = default;
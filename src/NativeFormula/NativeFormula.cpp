@@ -0,0 +1 @@
+#include "NativeFormula.h"
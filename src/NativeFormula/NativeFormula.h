@@ -0,0 +1,113 @@
+#pragma once
+
+#include <dlfcn.h>
+#include <cstdlib>
+#include <fstream>
+
+#include "../Differenctiator/Differentiator.h"
+#include "../Process/Process.h"
+#include "../String/String.h"
+#include "../Vector/Vector.h"
+
+// A formula compiled by the system C compiler (CC, or cc) from Formula::EmitC
+// and loaded with dlopen. When no compiler is available or compilation fails,
+// the same entry points run the tree evaluator instead.
+class NativeFormula {
+ public:
+  // values are indexed by variable ids, like in Formula::Evaluate.
+  using Function = double (*)(const double *values);
+  using ArrayFunction = void (*)(const double *points, size_t count,
+                                 size_t stride, double *results);
+
+  explicit NativeFormula(Formula formula)
+      : formula_(std::move(formula)), values_number_(formula_.ValuesNumber()) {
+    Compile();
+  }
+
+  NativeFormula(const NativeFormula &) = delete;
+  NativeFormula &operator=(const NativeFormula &) = delete;
+
+  ~NativeFormula() {
+    if (library_ != nullptr) {
+      dlclose(library_);
+    }
+  }
+
+  bool IsNative() const { return function_ != nullptr; }
+
+  // Null when the formula is not compiled.
+  Function GetFunction() const { return function_; }
+
+  ArrayFunction GetArrayFunction() const { return array_function_; }
+
+  // The smallest number of values the entry points read per point.
+  size_t ValuesNumber() const { return values_number_; }
+
+  double Evaluate(const double *values) const {
+    if (function_ != nullptr) {
+      return function_(values);
+    }
+    return formula_.Evaluate(
+        Vector<long double>(values, values + values_number_));
+  }
+
+  void Evaluate(const double *points, size_t count, size_t stride,
+                double *results) const {
+    if (array_function_ != nullptr) {
+      array_function_(points, count, stride, results);
+      return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      results[i] = Evaluate(points + i * stride);
+    }
+  }
+
+  const Formula &GetFormula() const { return formula_; }
+
+ private:
+  void Compile() {
+    auto dir = Process::MakeTempDirectory("formula");
+    if (!dir) {
+      return;
+    }
+
+    String source_filename = dir.value() + "/formula.c";
+    String library_filename = dir.value() + "/formula.so";
+    std::ofstream source(source_filename.c_str());
+    formula_.EmitC(source, kFunctionName);
+    source.close();
+
+    const char *compiler = std::getenv("CC");
+    if (!source.fail() &&
+        Process::Run({compiler != nullptr && *compiler != '\0' ? compiler
+                                                                : "cc",
+                      "-O2", "-shared", "-fPIC", "-o", library_filename,
+                      source_filename, "-lm"})) {
+      library_ = dlopen(library_filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+    }
+    Process::RemoveDirectory(dir.value());
+
+    if (library_ == nullptr) {
+      return;
+    }
+
+    auto function = reinterpret_cast<Function>(dlsym(library_, kFunctionName));
+    auto array_function = reinterpret_cast<ArrayFunction>(
+        dlsym(library_, (String(kFunctionName) + "_array").c_str()));
+    if (function == nullptr || array_function == nullptr) {
+      dlclose(library_);
+      library_ = nullptr;
+      return;
+    }
+    function_ = function;
+    array_function_ = array_function;
+  }
+
+  static constexpr const char *kFunctionName = "evaluate";
+
+  Formula formula_;
+  size_t values_number_;
+  void *library_ = nullptr;
+  Function function_ = nullptr;
+  ArrayFunction array_function_ = nullptr;
+};
@@ -0,0 +1 @@
+#include "Number.h"
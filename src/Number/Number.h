@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <sstream>
+
+#include "../String/String.h"
+
+// Numeric payload of NUMBER tokens. The binary value is always present; the
+// exact rational is kept while every operation that produced the number could
+// be carried out without rounding or overflow.
+class Number {
+ public:
+  struct Rational {
+    int64_t numerator_;
+    int64_t denominator_;
+  };
+
+  Number() = default;
+
+  explicit Number(long double value) : value_(value) {}
+
+  Number(int64_t numerator, int64_t denominator) {
+    exact_ = MakeRational(numerator, denominator);
+    value_ = exact_ ? ToValue(exact_.value())
+                    : static_cast<long double>(numerator) / denominator;
+  }
+
+  static Number Parse(const String &str) {
+    size_t position = 0;
+    bool negative = false;
+    if (position < str.size() &&
+        (str[position] == '-' || str[position] == '+')) {
+      negative = str[position++] == '-';
+    }
+
+    int64_t numerator = 0;
+    int64_t denominator = 1;
+    bool has_digits = false;
+    bool has_point = false;
+    bool overflow = false;
+    for (; position < str.size(); ++position) {
+      char symbol = str[position];
+      if (symbol == '.' && !has_point) {
+        has_point = true;
+        continue;
+      }
+      if (symbol < '0' || '9' < symbol) {
+        break;
+      }
+
+      has_digits = true;
+      overflow |= __builtin_mul_overflow(numerator, 10, &numerator);
+      overflow |= __builtin_add_overflow(numerator, symbol - '0', &numerator);
+      if (has_point) {
+        overflow |= __builtin_mul_overflow(denominator, 10, &denominator);
+      }
+    }
+
+    if (!has_digits || overflow || position != str.size()) {
+      return Number(std::stold(str));
+    }
+
+    return Number(negative ? -numerator : numerator, denominator);
+  }
+
+  long double GetValue() const { return value_; }
+
+  const std::optional<Rational> &GetExact() const { return exact_; }
+
+  bool IsInteger() const { return exact_ && exact_->denominator_ == 1; }
+
+  // Prints text the parser reads back to the same number: exact fractions
+  // as finite decimals where they have one and as (p/q) otherwise, inexact
+  // values in fixed notation, negatives as (0-x) since the parser has no
+  // unary minus, and NaN and infinity as (0/0) and (1/0).
+  void Print(std::ostream &out) const {
+    if (std::isnan(value_)) {
+      out << "(0/0)";
+    } else if (value_ < 0) {
+      out << "(0-";
+      (Number(0, 1) - *this).Print(out);
+      out << ')';
+    } else if (std::isinf(value_)) {
+      out << "(1/0)";
+    } else if (IsInteger()) {
+      out << exact_->numerator_;
+    } else if (exact_) {
+      if (!PrintDecimal(out, exact_.value())) {
+        out << '(' << exact_->numerator_ << '/' << exact_->denominator_
+            << ')';
+      }
+    } else {
+      PrintFixed(out, value_);
+    }
+  }
+
+  // Prints the value as a decimal, with every significant digit when it is
+  // not exact.
+  void PrintValue(std::ostream &out) const {
+    if (IsInteger()) {
+      out << exact_->numerator_;
+    } else if (!exact_ || !PrintDecimal(out, exact_.value())) {
+      auto precision =
+          out.precision(std::numeric_limits<long double>::max_digits10);
+      out << value_;
+      out.precision(precision);
+    }
+  }
+
+  String ToString() const {
+    if (IsInteger() && exact_->numerator_ >= 0) {
+      return std::to_string(exact_->numerator_);
+    }
+
+    std::stringstream stringstream;
+    Print(stringstream);
+    return stringstream.str();
+  }
+
+  friend Number operator+(const Number &left, const Number &right) {
+    if (left.exact_ && right.exact_) {
+      const auto &[a, b] = left.exact_.value();
+      const auto &[c, d] = right.exact_.value();
+      int64_t ad, cb, numerator, denominator;
+      if (!__builtin_mul_overflow(a, d, &ad) &&
+          !__builtin_mul_overflow(c, b, &cb) &&
+          !__builtin_add_overflow(ad, cb, &numerator) &&
+          !__builtin_mul_overflow(b, d, &denominator)) {
+        return Number(numerator, denominator);
+      }
+    }
+    return Number(left.value_ + right.value_);
+  }
+
+  friend Number operator-(const Number &left, const Number &right) {
+    if (right.exact_ && right.exact_->numerator_ != INT64_MIN) {
+      return left + Number(-right.exact_->numerator_,
+                           right.exact_->denominator_);
+    }
+    return Number(left.value_ - right.value_);
+  }
+
+  friend Number operator*(const Number &left, const Number &right) {
+    if (left.exact_ && right.exact_) {
+      const auto &[a, b] = left.exact_.value();
+      const auto &[c, d] = right.exact_.value();
+      int64_t numerator, denominator;
+      if (!__builtin_mul_overflow(a, c, &numerator) &&
+          !__builtin_mul_overflow(b, d, &denominator)) {
+        return Number(numerator, denominator);
+      }
+    }
+    return Number(left.value_ * right.value_);
+  }
+
+  friend Number operator/(const Number &left, const Number &right) {
+    if (left.exact_ && right.exact_ && right.exact_->numerator_ != 0) {
+      const auto &[a, b] = left.exact_.value();
+      const auto &[c, d] = right.exact_.value();
+      int64_t numerator, denominator;
+      if (!__builtin_mul_overflow(a, d, &numerator) &&
+          !__builtin_mul_overflow(b, c, &denominator)) {
+        return Number(numerator, denominator);
+      }
+    }
+    return Number(left.value_ / right.value_);
+  }
+
+  static Number Pow(const Number &base, const Number &exponent) {
+    if (base.exact_ && exponent.IsInteger() &&
+        std::abs(exponent.exact_->numerator_) <= kMaxExactExponent &&
+        (base.exact_->numerator_ != 0 || exponent.exact_->numerator_ >= 0)) {
+      Number result(1, 1);
+      for (int64_t i = 0; i < std::abs(exponent.exact_->numerator_); ++i) {
+        result = result * base;
+      }
+      if (exponent.exact_->numerator_ < 0) {
+        result = Number(1, 1) / result;
+      }
+      if (result.exact_) {
+        return result;
+      }
+    }
+    return Number(powl(base.value_, exponent.value_));
+  }
+
+  static Number Log(const Number &arg) {
+    if (arg.IsInteger() && arg.exact_->numerator_ == 1) {
+      return Number(0, 1);
+    }
+    return Number(std::log(arg.value_));
+  }
+
+  static Number Sin(const Number &arg) {
+    if (arg.IsInteger() && arg.exact_->numerator_ == 0) {
+      return Number(0, 1);
+    }
+    return Number(std::sin(arg.value_));
+  }
+
+  static Number Cos(const Number &arg) {
+    if (arg.IsInteger() && arg.exact_->numerator_ == 0) {
+      return Number(1, 1);
+    }
+    return Number(std::cos(arg.value_));
+  }
+
+ private:
+  static std::optional<Rational> MakeRational(int64_t numerator,
+                                              int64_t denominator) {
+    if (denominator == 0 || numerator == INT64_MIN ||
+        denominator == INT64_MIN) {
+      return {};
+    }
+    if (denominator < 0) {
+      numerator = -numerator;
+      denominator = -denominator;
+    }
+
+    int64_t divisor = std::gcd(numerator, denominator);
+    return Rational{numerator / divisor, denominator / divisor};
+  }
+
+  // Prints p/q as a decimal when q divides a power of ten that fits int64.
+  static bool PrintDecimal(std::ostream &out, const Rational &rational) {
+    int64_t numerator = rational.numerator_;
+    int64_t rest = rational.denominator_;
+    int64_t scale = 1;
+    size_t digits = 0;
+    while (rest > 1) {
+      int64_t factor = rest % 2 == 0 ? 2 : rest % 5 == 0 ? 5 : 0;
+      if (factor == 0 ||
+          __builtin_mul_overflow(numerator, 10 / factor, &numerator) ||
+          __builtin_mul_overflow(scale, 10, &scale)) {
+        return false;
+      }
+      rest /= factor;
+      ++digits;
+    }
+
+    uint64_t magnitude =
+        numerator < 0 ? -static_cast<uint64_t>(numerator) : numerator;
+    String fraction = std::to_string(magnitude % scale);
+    out << (numerator < 0 ? "-" : "") << magnitude / scale << '.'
+        << String(digits - fraction.size(), '0') << fraction;
+    return true;
+  }
+
+  // Prints a finite non-negative value with every significant digit and no
+  // exponent, which the tokenizer does not read.
+  static void PrintFixed(std::ostream &out, long double value) {
+    if (value == 0) {
+      out << 0;
+      return;
+    }
+
+    int digits = std::numeric_limits<long double>::max_digits10;
+    int exponent = static_cast<int>(std::floor(log10l(value)));
+    auto flags = out.flags();
+    auto precision = out.precision(std::max(0, digits - 1 - exponent));
+    out << std::fixed << value;
+    out.flags(flags);
+    out.precision(precision);
+  }
+
+  static long double ToValue(const Rational &rational) {
+    return static_cast<long double>(rational.numerator_) /
+           rational.denominator_;
+  }
+
+  static const int64_t kMaxExactExponent = 64;
+
+  long double value_ = 0;
+  std::optional<Rational> exact_;
+};
@@ -1,8 +1,15 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
 
+#include "../Number/Number.h"
 #include "../String/String.h"
 #include "../Tree/Tree.h"
 #include "../UnorderedMap/UnorderedMap.h"
@@ -26,44 +33,192 @@ class Parser {
     static const int SIN = 10;
     static const int COS = 11;
   };
-  struct Token {
-    int type_;
-    String str_;
+  // What every token of a type shares. Operators and functions are known by
+  // type alone; numbers and variables carry a payload in tokens_.
+  struct TypeInfo {
+    const char *str_;
     size_t priority_;
     size_t operands_number_;
-    bool is_function = false;
+    bool is_function_;
   };
 
+  static constexpr TypeInfo kTypes[] = {
+      {"(", 0, 0, false},   {")", 0, 0, false},   {"+", 1, 2, false},
+      {"-", 1, 2, false},   {"*", 2, 2, false},   {"/", 2, 2, false},
+      {"^", 3, 2, false},   {"", 0, 0, false},    {"", 0, 0, false},
+      {"log", 4, 1, true},  {"sin", 4, 1, true},  {"cos", 4, 1, true}};
+  static constexpr int kTypesNumber = sizeof(kTypes) / sizeof(kTypes[0]);
+
+  // Four bytes: the type in the low bits, so type checks and kTypes lookups
+  // need no dereference, and above them the index of the payload of a number
+  // or a variable in tokens_. A NUMBER token keeps its payload alive.
   class TokenRef {
    public:
     TokenRef() = default;
-    TokenRef(Parser *owner, size_t id) : id_(id), owner_(owner) {}
-    Token &operator*() { return owner_->tokens_[id_]; }
 
-    Token *operator->() { return &owner_->tokens_[id_]; }
+    TokenRef(const TokenRef &other) : bits_(other.bits_) { Acquire(); }
+
+    TokenRef(TokenRef &&other) noexcept : bits_(other.bits_) {
+      other.bits_ = 0;
+    }
+
+    TokenRef &operator=(const TokenRef &other) {
+      other.Acquire();
+      Release();
+      bits_ = other.bits_;
+      return *this;
+    }
+
+    TokenRef &operator=(TokenRef &&other) noexcept {
+      std::swap(bits_, other.bits_);
+      return *this;
+    }
+
+    ~TokenRef() { Release(); }
 
-    const Token &operator*() const { return owner_->tokens_[id_]; }
+    int Type() const { return bits_ & kTypeMask; }
 
-    const Token *operator->() const { return &owner_->tokens_[id_]; }
+    const TypeInfo &Info() const { return kTypes[Type()]; }
+
+    // The value of a NUMBER token.
+    const Number &GetNumber() const { return tokens_.GetNumber(Id()); }
+
+    // The interned id and the name of a VARIABLE token.
+    size_t GetSymbolId() const { return tokens_.GetVariable(Id()).symbol_id_; }
+
+    const String &GetName() const { return tokens_.GetVariable(Id()).name_; }
+
+    String ToString() const {
+      switch (Type()) {
+        case BaseTokenTypes::NUMBER:
+          return GetNumber().ToString();
+        case BaseTokenTypes::VARIABLE:
+          return GetName();
+        default:
+          return Info().str_;
+      }
+    }
+
+    void Print(std::ostream &out) const {
+      switch (Type()) {
+        case BaseTokenTypes::NUMBER:
+          GetNumber().Print(out);
+          break;
+        case BaseTokenTypes::VARIABLE:
+          out << GetName();
+          break;
+        default:
+          out << Info().str_;
+      }
+    }
 
    private:
-    size_t id_ = 0;
-    Parser *owner_ = nullptr;
+    friend Parser;
+
+    // Takes over a reference the store counted for the id.
+    TokenRef(uint32_t id, int type) : bits_(id << kTypeBits | type) {}
+
+    uint32_t Id() const { return bits_ >> kTypeBits; }
+
+    void Acquire() const {
+      if (Type() == BaseTokenTypes::NUMBER) {
+        tokens_.AcquireNumber(Id());
+      }
+    }
+
+    void Release() const {
+      if (Type() == BaseTokenTypes::NUMBER) {
+        tokens_.ReleaseNumber(Id());
+      }
+    }
+
+    uint32_t bits_ = 0;
   };
 
   using ParseTree = Tree<TokenRef>;
 
   Parser() { BaseInitialize(); }
 
-  TokenRef AddToken(Token token) {
-    tokens_.push_back(std::move(token));
-    TokenRef token_ref(this, tokens_.size() - 1);
-    tokens_refs_.insert({tokens_.back().str_, token_ref});
+  // The token of a number literal or a variable name. Like the other ways to
+  // add tokens, throws std::length_error when the ids run out.
+  // Number literals are not remembered by text, so their payloads go away
+  // with the last formula that holds them.
+  TokenRef AddToken(int type, const String &str) {
+    if (type != BaseTokenTypes::VARIABLE) {
+      return AddNumber(Number::Parse(str));
+    }
+    TokenRef token_ref(tokens_.AddVariable({InternSymbol(str), str}), type);
+    tokens_refs_.insert({str, token_ref});
     return token_ref;
   }
 
+  // Operator or function token of the given type, if there is one.
+  static std::optional<TokenRef> GetOperator(int type) {
+    if (type < 0 || kTypesNumber <= type ||
+        kTypes[type].operands_number_ == 0) {
+      return {};
+    }
+    return TokenRef(0, type);
+  }
+
+  // The token Parse would produce for the variable name; fails for names the
+  // parser would not read as one variable.
+  std::optional<TokenRef> GetVariable(const String &name) {
+    if (name.empty()) {
+      return {};
+    }
+    for (char symbol : name) {
+      if (symbol < 'a' || 'z' < symbol) {
+        return {};
+      }
+    }
+
+    auto token_iter = tokens_refs_.find(name);
+    if (token_iter != tokens_refs_.end()) {
+      if (token_iter->second.Type() != BaseTokenTypes::VARIABLE) {
+        return {};
+      }
+      return token_iter->second;
+    }
+
+    return AddToken(BaseTokenTypes::VARIABLE, name);
+  }
+
+  // Numbers produced by folding or substitution are not addressable by text,
+  // so they bypass tokens_refs_. They belong to no parser, and any thread may
+  // add them.
+  static TokenRef AddNumber(Number number) {
+    return TokenRef(tokens_.AddNumber(std::move(number)),
+                    BaseTokenTypes::NUMBER);
+  }
+
   void AddDelimiter(char delimiter) { delimiters_.insert({delimiter, Unit()}); }
 
+  // Variables are interned once: every VARIABLE token carries a dense id, so
+  // later passes compare and index by id instead of hashing names.
+  size_t InternSymbol(const String &name) {
+    auto symbol_iter = symbols_ids_.find(name);
+    if (symbol_iter != symbols_ids_.end()) {
+      return symbol_iter->second;
+    }
+
+    symbols_.push_back(name);
+    symbols_ids_.insert({name, symbols_.size() - 1});
+    return symbols_.size() - 1;
+  }
+
+  std::optional<size_t> FindSymbol(const String &name) const {
+    auto symbol_iter = symbols_ids_.find(name);
+    if (symbol_iter == symbols_ids_.end()) {
+      return {};
+    }
+    return symbol_iter->second;
+  }
+
+  const String &GetSymbolName(size_t id) const { return symbols_[id]; }
+
+  size_t SymbolsNumber() const { return symbols_.size(); }
+
   std::optional<ParseTree> Parse(String expr) {
     expr_ = std::move(expr);
     position_ = 0;
@@ -94,60 +249,10 @@ class Parser {
 
  private:
   void BaseInitialize() {
-    {
-      AddToken({.type_ = BaseTokenTypes::LBRACE,
-                .str_ = "(",
-                .priority_ = 0,
-                .operands_number_ = 0,
-                .is_function = false});
-      AddToken({.type_ = BaseTokenTypes::RBRACE,
-                .str_ = ")",
-                .priority_ = 0,
-                .operands_number_ = 0,
-                .is_function = false});
-
-      AddToken({.type_ = BaseTokenTypes::PLUS,
-                .str_ = "+",
-                .priority_ = 1,
-                .operands_number_ = 2,
-                .is_function = false});
-      AddToken({.type_ = BaseTokenTypes::MINUS,
-                .str_ = "-",
-                .priority_ = 1,
-                .operands_number_ = 2,
-                .is_function = false});
-
-      AddToken({.type_ = BaseTokenTypes::MULT,
-                .str_ = "*",
-                .priority_ = 2,
-                .operands_number_ = 2,
-                .is_function = false});
-      AddToken({.type_ = BaseTokenTypes::DIV,
-                .str_ = "/",
-                .priority_ = 2,
-                .operands_number_ = 2,
-                .is_function = false});
-
-      AddToken({.type_ = BaseTokenTypes::POW,
-                .str_ = "^",
-                .priority_ = 3,
-                .operands_number_ = 2,
-                .is_function = false});
-      AddToken({.type_ = BaseTokenTypes::LOG,
-                .str_ = "log",
-                .priority_ = 4,
-                .operands_number_ = 1,
-                .is_function = true});
-      AddToken({.type_ = BaseTokenTypes::SIN,
-                .str_ = "sin",
-                .priority_ = 4,
-                .operands_number_ = 1,
-                .is_function = true});
-      AddToken({.type_ = BaseTokenTypes::COS,
-                .str_ = "cos",
-                .priority_ = 4,
-                .operands_number_ = 1,
-                .is_function = true});
+    for (int type = 0; type < kTypesNumber; ++type) {
+      if (kTypes[type].str_[0] != '\0') {
+        tokens_refs_.insert({kTypes[type].str_, TokenRef(0, type)});
+      }
     }
 
     {
@@ -161,7 +266,7 @@ class Parser {
       return -1;
     }
 
-    if (token_stack_.back()->str_ == "(") {
+    if (token_stack_.back().Type() == BaseTokenTypes::LBRACE) {
       token_stack_.pop_back();
       return 1;
     }
@@ -170,7 +275,7 @@ class Parser {
         std::make_shared<ParseTree::Node>(token_stack_.back());
     token_stack_.pop_back();
 
-    size_t operands_number = new_node->value_->operands_number_;
+    size_t operands_number = new_node->value_.Info().operands_number_;
     assert(operands_number > 0);
 
     if (stack_.size() < operands_number) {
@@ -188,12 +293,12 @@ class Parser {
   }
 
   int ProcessToken(TokenRef token_ref) {
-    if (token_ref->str_ == "(") {
+    if (token_ref.Type() == BaseTokenTypes::LBRACE) {
       token_stack_.push_back(token_ref);
       return 0;
     }
 
-    if (token_ref->str_ == ")") {
+    if (token_ref.Type() == BaseTokenTypes::RBRACE) {
       do {
         int res = MoveTokenFromStack();
         if (res == -1) {
@@ -205,11 +310,12 @@ class Parser {
       } while (true);
     }
 
-    if (token_ref->priority_ == 0) {
+    if (token_ref.Info().priority_ == 0) {
       stack_.push_back(std::make_shared<ParseTree::Node>(token_ref));
     } else {
       while (!token_stack_.empty() &&
-             token_ref->priority_ <= token_stack_.back()->priority_) {
+             token_ref.Info().priority_ <=
+                 token_stack_.back().Info().priority_) {
         if (MoveTokenFromStack() != 0) {
           return -1;
         }
@@ -223,8 +329,12 @@ class Parser {
   std::optional<TokenRef> TryNumberOrVariableIteration() {
     String partial_token;
     int type = BaseTokenTypes::NUMBER;
-    while (position_ < expr_.size() && '0' <= expr_[position_] &&
-           expr_[position_] <= '9') {
+    bool has_point = false;
+    while (position_ < expr_.size() &&
+           (('0' <= expr_[position_] && expr_[position_] <= '9') ||
+            (expr_[position_] == '.' && !has_point &&
+             !partial_token.empty()))) {
+      has_point |= expr_[position_] == '.';
       partial_token += expr_[position_++];
     }
 
@@ -245,11 +355,7 @@ class Parser {
       return token_iter->second;
     }
 
-    return AddToken({.type_ = type,
-                     .str_ = partial_token,
-                     .priority_ = 0,
-                     .operands_number_ = 0,
-                     .is_function = false});
+    return AddToken(type, partial_token);
   }
 
   std::optional<TokenRef> Iterate(bool &error) {
@@ -280,12 +386,242 @@ class Parser {
     return {};
   }
 
+  static const int kTypeBits = 4;
+  static const uint32_t kTypeMask = (1 << kTypeBits) - 1;
+
+  // Payloads of the tokens of every parser, so a handle needs no owner.
+  // Records never move: they are kept in chunks found through a fixed
+  // directory, so any thread may read them while another one adds more. A
+  // directory entry is set before the ids of its chunk are handed out, hence
+  // reads need no lock. Number ids are handed out in batches of kBatchSize,
+  // and each batch counts the handles to its numbers, the thread that fills
+  // it and the recent table entries that point into it; a batch whose count
+  // drops to zero goes to a free list and is handed out again. Variables are
+  // few, one per name a parser has read, and stay until exit. To keep the
+  // store from growing with repeated work, every thread keeps the ids of
+  // exact numbers it recently added in a table of 2^kRecentBits entries, and
+  // an equal number found there reuses its id.
+  class TokenStore {
+   public:
+    struct Variable {
+      size_t symbol_id_;
+      String name_;
+    };
+
+    constexpr TokenStore() = default;
+
+    TokenStore(const TokenStore &) = delete;
+    TokenStore &operator=(const TokenStore &) = delete;
+
+    const Number &GetNumber(uint32_t id) const { return numbers_.Get(id); }
+
+    const Variable &GetVariable(uint32_t id) const {
+      return variables_.Get(id);
+    }
+
+    // The returned id carries one reference for the caller. A thread locks
+    // once per batch, so folding on a pool rarely waits.
+    uint32_t AddNumber(Number number) {
+      thread_local NumberBatch batch;
+      const auto &exact = number.GetExact();
+      RecentNumber *recent = nullptr;
+      if (exact) {
+        recent = &batch.recent_[RecentIndex(exact.value())];
+        if (recent->denominator_ == exact->denominator_ &&
+            recent->numerator_ == exact->numerator_) {
+          AcquireNumber(recent->id_);
+          return recent->id_;
+        }
+      }
+
+      if (batch.next_ == batch.end_) {
+        uint32_t previous_end = batch.end_;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          batch.next_ = ReserveBatch();
+        }
+        batch.end_ = batch.next_ + kBatchSize;
+        if (previous_end != 0) {
+          ReleaseNumber(previous_end - 1);
+        }
+      }
+      uint32_t id = batch.next_++;
+      numbers_.Set(id, std::move(number));
+      AcquireNumber(id);
+      if (recent != nullptr) {
+        if (recent->denominator_ != 0) {
+          ReleaseNumber(recent->id_);
+        }
+        *recent = {exact->numerator_, exact->denominator_, id};
+        AcquireNumber(id);
+      }
+      return id;
+    }
+
+    void AcquireNumber(uint32_t id) {
+      References(id).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void ReleaseNumber(uint32_t id) {
+      if (References(id).fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        numbers_.Link(id >> kBatchBits) = free_batch_;
+        free_batch_ = id >> kBatchBits;
+      }
+    }
+
+    uint32_t AddVariable(Variable variable) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      uint32_t id = variables_.Reserve(1);
+      variables_.Set(id, std::move(variable));
+      return id;
+    }
+
+   private:
+    static const uint32_t kChunkBits = 12;
+    static const uint32_t kChunkSize = 1 << kChunkBits;
+    static const uint32_t kMaxIds = 1 << (32 - kTypeBits);
+    static const uint32_t kBatchBits = 8;
+    static const uint32_t kBatchSize = 1 << kBatchBits;
+    static const uint32_t kNoBatch = kMaxIds >> kBatchBits;
+    static const int kRecentBits = 10;
+    static const uint64_t kHashMultiplier = 0x9e3779b97f4a7c15;
+
+    template <class T>
+    class Chunks {
+     public:
+      constexpr Chunks() = default;
+
+      ~Chunks() {
+        for (auto &chunk : chunks_) {
+          delete chunk;
+        }
+      }
+
+      const T &Get(uint32_t id) const {
+        return chunks_[id >> kChunkBits]->values_[id & (kChunkSize - 1)];
+      }
+
+      void Set(uint32_t id, T value) {
+        chunks_[id >> kChunkBits]->values_[id & (kChunkSize - 1)] =
+            std::move(value);
+      }
+
+      // The reference count and the free list link of a batch.
+      std::atomic<uint32_t> &References(uint32_t batch) {
+        return BatchOf(batch).references_;
+      }
+
+      uint32_t &Link(uint32_t batch) { return BatchOf(batch).next_free_; }
+
+      // Hands out number consecutive ids with their chunks allocated, or
+      // throws std::length_error when the ids run out. The caller holds the
+      // lock.
+      uint32_t Reserve(uint32_t number) {
+        if (kMaxIds - size_ < number) {
+          throw std::length_error("Parser: out of token ids");
+        }
+        for (uint32_t chunk = size_ >> kChunkBits;
+             chunk <= (size_ + number - 1) >> kChunkBits; ++chunk) {
+          if (chunks_[chunk] == nullptr) {
+            chunks_[chunk] = new Chunk;
+          }
+        }
+        size_ += number;
+        return size_ - number;
+      }
+
+     private:
+      struct Batch {
+        std::atomic<uint32_t> references_{0};
+        uint32_t next_free_ = kNoBatch;
+      };
+
+      struct Chunk {
+        T values_[kChunkSize];
+        Batch batches_[kChunkSize >> kBatchBits];
+      };
+
+      Batch &BatchOf(uint32_t batch) {
+        uint32_t id = batch << kBatchBits;
+        return chunks_[id >> kChunkBits]
+            ->batches_[(id & (kChunkSize - 1)) >> kBatchBits];
+      }
+
+      Chunk *chunks_[kMaxIds >> kChunkBits] = {};
+      uint32_t size_ = 0;
+    };
+
+    // An exact number the thread added, found by RecentIndex. The
+    // denominator of an empty entry is 0.
+    struct RecentNumber {
+      int64_t numerator_;
+      int64_t denominator_;
+      uint32_t id_;
+    };
+
+    // The batch a thread fills, which it holds a reference to while end_ is
+    // not 0.
+    struct NumberBatch {
+      ~NumberBatch() {
+        for (const auto &recent : recent_) {
+          if (recent.denominator_ != 0) {
+            tokens_.ReleaseNumber(recent.id_);
+          }
+        }
+        if (end_ != 0) {
+          tokens_.ReleaseNumber(end_ - 1);
+        }
+      }
+
+      uint32_t next_ = 0;
+      uint32_t end_ = 0;
+      RecentNumber recent_[1 << kRecentBits] = {};
+    };
+
+    // A free batch, or a new one, with the reference of the thread that
+    // fills it. The caller holds the lock.
+    uint32_t ReserveBatch() {
+      uint32_t batch = free_batch_;
+      if (batch != kNoBatch) {
+        free_batch_ = numbers_.Link(batch);
+      } else {
+        batch = numbers_.Reserve(kBatchSize) >> kBatchBits;
+      }
+      numbers_.References(batch).store(1, std::memory_order_relaxed);
+      return batch << kBatchBits;
+    }
+
+    std::atomic<uint32_t> &References(uint32_t id) {
+      return numbers_.References(id >> kBatchBits);
+    }
+
+    static size_t RecentIndex(const Number::Rational &rational) {
+      uint64_t hash = static_cast<uint64_t>(rational.numerator_) *
+                          kHashMultiplier ^
+                      static_cast<uint64_t>(rational.denominator_);
+      return (hash * kHashMultiplier) >> (64 - kRecentBits);
+    }
+
+    Chunks<Number> numbers_;
+    Chunks<Variable> variables_;
+    uint32_t free_batch_ = kNoBatch;
+    std::mutex mutex_;
+  };
+
+  // Constant-initialized, so reads need no guard and the store outlives
+  // every other static.
+  static TokenStore tokens_;
+
  private:
   UnorderedMap<String, TokenRef> tokens_refs_;
-  Vector<Token> tokens_;
+  UnorderedMap<String, size_t> symbols_ids_;
+  Vector<String> symbols_;
   UnorderedSet<char> delimiters_;
   String expr_;
   size_t position_ = 0;
   Vector<ParseTree::Node::Ptr> stack_{};
   Vector<TokenRef> token_stack_;
 };
+
+inline Parser::TokenStore Parser::tokens_;
@@ -0,0 +1 @@
+#include "Process.h"
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <optional>
+
+#include "../String/String.h"
+#include "../Vector/Vector.h"
+
+// Helpers for running external tools (TeX, the C compiler) in scratch
+// directories. Tools are started with posix_spawn, so a process with a large
+// heap does not pay for copying its page tables.
+class Process {
+ public:
+  // Runs arguments[0], looked up in PATH, with stdio redirected to /dev/null
+  // and reports whether it exited with status 0.
+  static bool Run(const Vector<String> &arguments) {
+    Vector<char *> argv;
+    for (const auto &argument : arguments) {
+      argv.push_back(const_cast<char *>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.begin(),
+                             environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) {
+      return false;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+      if (errno != EINTR) {
+        return false;
+      }
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+
+  // Creates a private directory in TMPDIR, or /tmp.
+  static std::optional<String> MakeTempDirectory(const String &prefix) {
+    const char *tmpdir = std::getenv("TMPDIR");
+    if (tmpdir == nullptr || *tmpdir == '\0') {
+      tmpdir = "/tmp";
+    }
+
+    String dir = String(tmpdir) + "/" + prefix + "-XXXXXX";
+    if (mkdtemp(dir.data()) == nullptr) {
+      return {};
+    }
+    return dir;
+  }
+
+  static void RemoveDirectory(const String &dir) {
+    std::error_code error;
+    std::filesystem::remove_all(dir, error);
+  }
+};
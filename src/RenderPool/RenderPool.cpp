@@ -0,0 +1 @@
+#include "RenderPool.h"
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <condition_variable>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
+
+#include "../Differenctiator/Differentiator.h"
+#include "../Process/Process.h"
+#include "../String/String.h"
+#include "../Vector/Vector.h"
+
+// Renders formulas to PDF on a bounded number of concurrent TeX processes.
+// LaTeX is generated on the calling thread (formulas share one parser), only
+// the TeX runs happen in the workers.
+class RenderPool {
+ public:
+  explicit RenderPool(size_t max_processes) {
+    for (size_t i = 0; i < std::max<size_t>(max_processes, 1); ++i) {
+      workers_.push_back(std::thread([this] { Work(); }));
+    }
+  }
+
+  RenderPool(const RenderPool &) = delete;
+  RenderPool &operator=(const RenderPool &) = delete;
+
+  // Finishes every queued render before returning.
+  ~RenderPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    has_tasks_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  std::future<std::optional<String>> Render(const Formula &formula) {
+    std::stringstream source;
+    formula.PrintLaTeXDocument(source);
+    return RenderSource(source.str());
+  }
+
+  std::future<std::optional<String>> RenderSource(String source) {
+    Task task{.source_ = std::move(source), .result_ = {}};
+    auto result = task.result_.get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    has_tasks_.notify_one();
+    return result;
+  }
+
+  // Same conversion as texcaller_convert: pdflatex is rerun in a private
+  // temporary directory until the .aux file stabilizes.
+  static std::optional<String> Convert(const String &source) {
+    auto dir = Process::MakeTempDirectory("differentiator");
+    if (!dir) {
+      return {};
+    }
+
+    auto result = ConvertIn(dir.value(), source);
+    Process::RemoveDirectory(dir.value());
+    return result;
+  }
+
+ private:
+  struct Task {
+    String source_;
+    std::promise<std::optional<String>> result_;
+  };
+
+  void Work() {
+    while (true) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        has_tasks_.wait(lock, [this] {
+          return stopped_ || next_task_ < tasks_.size();
+        });
+        if (next_task_ == tasks_.size()) {
+          return;
+        }
+
+        task = std::move(tasks_[next_task_++]);
+        if (next_task_ == tasks_.size()) {
+          tasks_.resize(0);
+          next_task_ = 0;
+        }
+      }
+
+      task.result_.set_value(Convert(task.source_));
+    }
+  }
+
+  static std::optional<String> ConvertIn(const String &dir,
+                                         const String &source) {
+    String source_filename = dir + "/texput.tex";
+    if (!WriteFile(source_filename, source)) {
+      return {};
+    }
+
+    std::optional<String> aux;
+    for (int runs = 1; runs <= kMaxTeXRuns; ++runs) {
+      if (!RunTeX(dir, source_filename)) {
+        return {};
+      }
+
+      auto new_aux = ReadFile(dir + "/texput.aux");
+      if (new_aux == aux) {
+        return ReadFile(dir + "/texput.pdf");
+      }
+      aux = std::move(new_aux);
+    }
+
+    return {};
+  }
+
+  static bool RunTeX(const String &dir, const String &source_filename) {
+    return Process::Run({"pdflatex", "-interaction=batchmode",
+                         "-halt-on-error", "-file-line-error",
+                         "-no-shell-escape", "-output-directory=" + dir,
+                         source_filename});
+  }
+
+  static bool WriteFile(const String &filename, const String &data) {
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    out.write(data.data(), data.size());
+    out.close();
+    return !out.fail();
+  }
+
+  static std::optional<String> ReadFile(const String &filename) {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in) {
+      return {};
+    }
+
+    std::stringstream data;
+    data << in.rdbuf();
+    return data.str();
+  }
+
+  static const int kMaxTeXRuns = 5;
+
+  Vector<std::thread> workers_;
+  Vector<Task> tasks_;
+  size_t next_task_ = 0;
+  bool stopped_ = false;
+  std::mutex mutex_;
+  std::condition_variable has_tasks_;
+};
@@ -0,0 +1 @@
+#include "StaticFormula.h"
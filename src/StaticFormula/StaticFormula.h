@@ -0,0 +1,477 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <utility>
+
+#include "../String/String.h"
+
+// Formulas fixed at build time, written as types that mirror
+// Parser::BaseTokenTypes:
+//   using F = StaticFormula::Mul<StaticFormula::Var<'x'>,
+//                                StaticFormula::Sin<StaticFormula::Var<'x'>>>;
+//   using D = StaticFormula::Derivative<F, 'x'>;
+//   double value = D::Evaluate(StaticFormula::Point({{'x', 1.5}}));
+// Derivatives follow the rules of Differentiator::ProcessNode and are pruned
+// while they are built, with the neutral-element and constant-folding rules of
+// Formula::Optimize, so no tree exists at run time. Only folds that stay exact
+// integers are done. Formulas without log, sin and cos also evaluate in
+// constant expressions.
+class StaticFormula {
+ public:
+  // Values of the variables 'a'..'z'.
+  using Values = std::array<double, 26>;
+
+  static constexpr Values Point(
+      std::initializer_list<std::pair<char, double>> values) {
+    Values point{};
+    for (const auto &[name, value] : values) {
+      point[name - 'a'] = value;
+    }
+    return point;
+  }
+
+  template <int64_t Value>
+  struct Const {
+    static constexpr bool kIsConst = true;
+    static constexpr int64_t kValue = Value;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return false;
+    }
+
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      return Const<0>();
+    }
+
+    static constexpr double Evaluate(const Values &) { return Value; }
+
+    // The parser reads no unary minus.
+    static void Print(std::ostream &out) {
+      if (Value < 0) {
+        out << "(0-" << -Value << ')';
+      } else {
+        out << Value;
+      }
+    }
+  };
+
+  template <char Name>
+  struct Var {
+    static_assert('a' <= Name && Name <= 'z');
+    static constexpr bool kIsConst = false;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return Name == Variable;
+    }
+
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      return Const<Name == Variable ? 1 : 0>();
+    }
+
+    static constexpr double Evaluate(const Values &values) {
+      return values[Name - 'a'];
+    }
+
+    static void Print(std::ostream &out) { out << Name; }
+  };
+
+  template <class Left, class Right>
+  struct Add {
+    static constexpr bool kIsConst = false;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return Left::template DependsOn<Variable>() ||
+             Right::template DependsOn<Variable>();
+    }
+
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      return MakeAdd(Left::template Differentiate<Variable>(),
+                     Right::template Differentiate<Variable>());
+    }
+
+    static constexpr double Evaluate(const Values &values) {
+      return Left::Evaluate(values) + Right::Evaluate(values);
+    }
+
+    static void Print(std::ostream &out) {
+      PrintBinary<Left, Right>(out, '+');
+    }
+  };
+
+  template <class Left, class Right>
+  struct Sub {
+    static constexpr bool kIsConst = false;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return Left::template DependsOn<Variable>() ||
+             Right::template DependsOn<Variable>();
+    }
+
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      return MakeSub(Left::template Differentiate<Variable>(),
+                     Right::template Differentiate<Variable>());
+    }
+
+    static constexpr double Evaluate(const Values &values) {
+      return Left::Evaluate(values) - Right::Evaluate(values);
+    }
+
+    static void Print(std::ostream &out) {
+      PrintBinary<Left, Right>(out, '-');
+    }
+  };
+
+  template <class Left, class Right>
+  struct Mul {
+    static constexpr bool kIsConst = false;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return Left::template DependsOn<Variable>() ||
+             Right::template DependsOn<Variable>();
+    }
+
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      return MakeAdd(
+          MakeMul(Left::template Differentiate<Variable>(), Right()),
+          MakeMul(Right::template Differentiate<Variable>(), Left()));
+    }
+
+    static constexpr double Evaluate(const Values &values) {
+      return Left::Evaluate(values) * Right::Evaluate(values);
+    }
+
+    static void Print(std::ostream &out) {
+      PrintBinary<Left, Right>(out, '*');
+    }
+  };
+
+  template <class Left, class Right>
+  struct Div {
+    static constexpr bool kIsConst = false;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return Left::template DependsOn<Variable>() ||
+             Right::template DependsOn<Variable>();
+    }
+
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      return MakeDiv(
+          MakeSub(MakeMul(Left::template Differentiate<Variable>(), Right()),
+                  MakeMul(Right::template Differentiate<Variable>(), Left())),
+          MakePow(Right(), Const<2>()));
+    }
+
+    static constexpr double Evaluate(const Values &values) {
+      return Left::Evaluate(values) / Right::Evaluate(values);
+    }
+
+    static void Print(std::ostream &out) {
+      PrintBinary<Left, Right>(out, '/');
+    }
+  };
+
+  template <class Left, class Right>
+  struct Pow {
+    static constexpr bool kIsConst = false;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return Left::template DependsOn<Variable>() ||
+             Right::template DependsOn<Variable>();
+    }
+
+    // The rule depends on which side has the variable, like in
+    // Differentiator::ProcessDiff.
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      if constexpr (!Right::template DependsOn<Variable>()) {
+        // (f ^ c)' = c * f ^ (c - 1) * f'
+        return MakeMul(
+            MakeMul(Right(), MakePow(Left(), MakeSub(Right(), Const<1>()))),
+            Left::template Differentiate<Variable>());
+      } else if constexpr (!Left::template DependsOn<Variable>()) {
+        // (c ^ g)' = c ^ g * log(c) * g'
+        return MakeMul(MakeMul(MakePow(Left(), Right()), MakeLog(Left())),
+                       Right::template Differentiate<Variable>());
+      } else {
+        // (f ^ g)' = f ^ (g - 1) * (g * f' + f * log(f) * g')
+        return MakeMul(
+            MakePow(Left(), MakeSub(Right(), Const<1>())),
+            MakeAdd(
+                MakeMul(Right(), Left::template Differentiate<Variable>()),
+                MakeMul(Left(),
+                        MakeMul(MakeLog(Left()),
+                                Right::template Differentiate<Variable>()))));
+      }
+    }
+
+    // Integer exponents are multiplied out, so they evaluate in constant
+    // expressions too.
+    static constexpr double Evaluate(const Values &values) {
+      if constexpr (Right::kIsConst) {
+        constexpr int64_t kExponent =
+            Right::kValue < 0 ? -Right::kValue : Right::kValue;
+        double base = Left::Evaluate(values);
+        double result = 1;
+        for (int64_t i = 0; i < kExponent; ++i) {
+          result *= base;
+        }
+        return Right::kValue < 0 ? 1 / result : result;
+      } else {
+        return std::pow(Left::Evaluate(values), Right::Evaluate(values));
+      }
+    }
+
+    static void Print(std::ostream &out) {
+      PrintBinary<Left, Right>(out, '^');
+    }
+  };
+
+  template <class Arg>
+  struct Log {
+    static constexpr bool kIsConst = false;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return Arg::template DependsOn<Variable>();
+    }
+
+    // log(f)' = f' / f
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      return MakeDiv(Arg::template Differentiate<Variable>(), Arg());
+    }
+
+    static double Evaluate(const Values &values) {
+      return std::log(Arg::Evaluate(values));
+    }
+
+    static void Print(std::ostream &out) { PrintFunction<Arg>(out, "log"); }
+  };
+
+  template <class Arg>
+  struct Sin {
+    static constexpr bool kIsConst = false;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return Arg::template DependsOn<Variable>();
+    }
+
+    // sin(f)' = f' * cos(f)
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      return MakeMul(Arg::template Differentiate<Variable>(), MakeCos(Arg()));
+    }
+
+    static double Evaluate(const Values &values) {
+      return std::sin(Arg::Evaluate(values));
+    }
+
+    static void Print(std::ostream &out) { PrintFunction<Arg>(out, "sin"); }
+  };
+
+  template <class Arg>
+  struct Cos {
+    static constexpr bool kIsConst = false;
+
+    template <char Variable>
+    static constexpr bool DependsOn() {
+      return Arg::template DependsOn<Variable>();
+    }
+
+    // cos(f)' = 0 - f' * sin(f)
+    template <char Variable>
+    static constexpr auto Differentiate() {
+      return MakeSub(Const<0>(),
+                     MakeMul(Arg::template Differentiate<Variable>(),
+                             MakeSin(Arg())));
+    }
+
+    static double Evaluate(const Values &values) {
+      return std::cos(Arg::Evaluate(values));
+    }
+
+    static void Print(std::ostream &out) { PrintFunction<Arg>(out, "cos"); }
+  };
+
+  template <class Expr, char Variable>
+  using Derivative = decltype(Expr::template Differentiate<Variable>());
+
+  // Text that Parser reads back into the same tree.
+  template <class Expr>
+  static String ToString() {
+    std::stringstream out;
+    Expr::Print(out);
+    return out.str();
+  }
+
+ private:
+  template <class Expr>
+  static constexpr bool IsConst(int64_t value) {
+    if constexpr (Expr::kIsConst) {
+      return Expr::kValue == value;
+    } else {
+      return false;
+    }
+  }
+
+  template <class Left, class Right>
+  static constexpr bool AreConsts() {
+    return Left::kIsConst && Right::kIsConst;
+  }
+
+  template <class Left, class Right>
+  static constexpr auto MakeAdd(Left, Right) {
+    if constexpr (AreConsts<Left, Right>()) {
+      return Const<Left::kValue + Right::kValue>();
+    } else if constexpr (IsConst<Left>(0)) {
+      return Right();
+    } else if constexpr (IsConst<Right>(0)) {
+      return Left();
+    } else {
+      return Add<Left, Right>();
+    }
+  }
+
+  template <class Left, class Right>
+  static constexpr auto MakeSub(Left, Right) {
+    if constexpr (AreConsts<Left, Right>()) {
+      return Const<Left::kValue - Right::kValue>();
+    } else if constexpr (IsConst<Right>(0)) {
+      return Left();
+    } else {
+      return Sub<Left, Right>();
+    }
+  }
+
+  template <class Left, class Right>
+  static constexpr auto MakeMul(Left, Right) {
+    if constexpr (AreConsts<Left, Right>()) {
+      return Const<Left::kValue * Right::kValue>();
+    } else if constexpr (IsConst<Left>(1)) {
+      return Right();
+    } else if constexpr (IsConst<Right>(1)) {
+      return Left();
+    } else if constexpr (IsConst<Left>(0)) {
+      return Left();
+    } else if constexpr (IsConst<Right>(0)) {
+      return Right();
+    } else {
+      return Mul<Left, Right>();
+    }
+  }
+
+  template <class Left, class Right>
+  static constexpr auto MakeDiv(Left, Right) {
+    if constexpr (AreConsts<Left, Right>()) {
+      if constexpr (Right::kValue != 0 && Left::kValue % Right::kValue == 0) {
+        return Const<Left::kValue / Right::kValue>();
+      } else {
+        return Div<Left, Right>();
+      }
+    } else if constexpr (IsConst<Left>(0)) {
+      return Left();
+    } else if constexpr (IsConst<Right>(1)) {
+      return Left();
+    } else {
+      return Div<Left, Right>();
+    }
+  }
+
+  template <class Left, class Right>
+  static constexpr auto MakePow(Left, Right) {
+    if constexpr (AreConsts<Left, Right>()) {
+      if constexpr (FoldPow(Left::kValue, Right::kValue).has_value()) {
+        return Const<FoldPow(Left::kValue, Right::kValue).value()>();
+      } else {
+        return Pow<Left, Right>();
+      }
+    } else if constexpr (IsConst<Left>(0) || IsConst<Left>(1) ||
+                         IsConst<Right>(1)) {
+      return Left();
+    } else if constexpr (IsConst<Right>(0)) {
+      return Const<1>();
+    } else {
+      return Pow<Left, Right>();
+    }
+  }
+
+  template <class Arg>
+  static constexpr auto MakeLog(Arg) {
+    if constexpr (IsConst<Arg>(1)) {
+      return Const<0>();
+    } else {
+      return Log<Arg>();
+    }
+  }
+
+  template <class Arg>
+  static constexpr auto MakeSin(Arg) {
+    if constexpr (IsConst<Arg>(0)) {
+      return Const<0>();
+    } else {
+      return Sin<Arg>();
+    }
+  }
+
+  template <class Arg>
+  static constexpr auto MakeCos(Arg) {
+    if constexpr (IsConst<Arg>(0)) {
+      return Const<1>();
+    } else {
+      return Cos<Arg>();
+    }
+  }
+
+  // base ^ exponent when it is an integer that fits.
+  static constexpr std::optional<int64_t> FoldPow(int64_t base,
+                                                  int64_t exponent) {
+    if (exponent < 0 || exponent > kMaxFoldedExponent) {
+      return {};
+    }
+    int64_t result = 1;
+    for (int64_t i = 0; i < exponent; ++i) {
+      if (__builtin_mul_overflow(result, base, &result)) {
+        return {};
+      }
+    }
+    return result;
+  }
+
+  template <class Left, class Right>
+  static void PrintBinary(std::ostream &out, char operation) {
+    out << '(';
+    Left::Print(out);
+    out << operation;
+    Right::Print(out);
+    out << ')';
+  }
+
+  template <class Arg>
+  static void PrintFunction(std::ostream &out, const char *name) {
+    out << name << '(';
+    Arg::Print(out);
+    out << ')';
+  }
+
+  static const int64_t kMaxFoldedExponent = 64;
+};
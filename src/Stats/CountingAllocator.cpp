@@ -0,0 +1,20 @@
+#include <cstdlib>
+#include <new>
+
+#include "Stats.h"
+
+// Replaces the global operator new with one that feeds the Stats counters.
+// It is not part of project_lib: only executables that report allocations
+// link it, through the counting_allocator object library.
+void *operator new(size_t size) {
+  ++Stats::thread_allocations_;
+  Stats::thread_bytes_ += size;
+  if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
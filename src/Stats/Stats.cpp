@@ -0,0 +1,4 @@
+#include "Stats.h"
+
+thread_local size_t Stats::thread_allocations_ = 0;
+thread_local size_t Stats::thread_bytes_ = 0;
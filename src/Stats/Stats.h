@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+
+#include "../String/String.h"
+#include "../Vector/Vector.h"
+
+// Opt-in instrumentation of the differentiation pipeline. Every probe takes a
+// Stats pointer and does nothing but a null check when it is not given.
+struct Stats {
+  struct Phase {
+    const char *name_;
+    uint64_t nanoseconds_ = 0;
+    size_t allocations_ = 0;
+    size_t bytes_ = 0;
+  };
+
+  // Records the time and the allocations of the calling thread from
+  // construction until Stop or destruction as a phase of stats.
+  class PhaseScope {
+   public:
+    PhaseScope(Stats *stats, const char *name) : stats_(stats), name_(name) {
+      if (stats_ != nullptr) {
+        allocations_ = Allocations();
+        bytes_ = AllocatedBytes();
+        start_ = std::chrono::steady_clock::now();
+      }
+    }
+
+    PhaseScope(const PhaseScope &) = delete;
+    PhaseScope &operator=(const PhaseScope &) = delete;
+
+    ~PhaseScope() { Stop(); }
+
+    void Stop() {
+      if (stats_ == nullptr) {
+        return;
+      }
+
+      auto finish = std::chrono::steady_clock::now();
+      Phase phase{.name_ = name_,
+                  .nanoseconds_ = static_cast<uint64_t>(
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          finish - start_)
+                          .count()),
+                  .allocations_ = Allocations() - allocations_,
+                  .bytes_ = AllocatedBytes() - bytes_};
+      stats_->phases_.push_back(phase);
+      stats_ = nullptr;
+    }
+
+   private:
+    Stats *stats_;
+    const char *name_;
+    std::chrono::steady_clock::time_point start_;
+    size_t allocations_ = 0;
+    size_t bytes_ = 0;
+  };
+
+  // Allocation counters of the calling thread, maintained by the replaced
+  // global operator new in CountingAllocator.cpp. They stay at zero in
+  // executables that do not link counting_allocator.
+  static size_t Allocations() { return thread_allocations_; }
+
+  static size_t AllocatedBytes() { return thread_bytes_; }
+
+  String ToJSON() const {
+    std::stringstream json;
+    json << "{\"phases\": [";
+    for (size_t i = 0; i < phases_.size(); ++i) {
+      const auto &phase = phases_[i];
+      json << (i == 0 ? "" : ", ") << "{\"name\": \"" << phase.name_
+           << "\", \"nanoseconds\": " << phase.nanoseconds_
+           << ", \"allocations\": " << phase.allocations_
+           << ", \"bytes\": " << phase.bytes_ << "}";
+    }
+    json << "], \"nodes_before_optimize\": " << nodes_before_optimize_
+         << ", \"nodes_after_optimize\": " << nodes_after_optimize_ << "}";
+    return json.str();
+  }
+
+  Vector<Phase> phases_;
+  size_t nodes_before_optimize_ = 0;
+  size_t nodes_after_optimize_ = 0;
+
+  static thread_local size_t thread_allocations_;
+  static thread_local size_t thread_bytes_;
+};
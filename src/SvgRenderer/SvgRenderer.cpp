@@ -0,0 +1 @@
+#include "SvgRenderer.h"
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <sstream>
+
+#include "../Differenctiator/Differentiator.h"
+#include "../String/String.h"
+#include "../Vector/Vector.h"
+
+// Lays a formula out the way Formula::GetLaTeX does (the same brackets,
+// fractions for DIV, superscripts for POW) and writes it as a standalone SVG
+// image. Glyph widths are estimated, which is enough for previews without
+// TeX.
+class SvgRenderer {
+ public:
+  static void Print(const Formula &formula, std::ostream &out) {
+    Vector<Layout> layouts = Measure(formula);
+    if (layouts.empty()) {
+      out << "<svg xmlns=\"http://www.w3.org/2000/svg\"/>";
+      return;
+    }
+
+    const auto &root = layouts[0];
+    out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\""
+        << root.width_ + 2 * kMargin << "\" height=\""
+        << root.ascent_ + root.descent_ + 2 * kMargin
+        << "\" font-family=\"serif\">";
+
+    Vector<Frame> frames;
+    frames.push_back({kMargin, kMargin + root.ascent_});
+    size_t index = 0;
+    formula.GetTree().Traverse(
+        [&](const Parser::ParseTree::Node &node,
+            const Parser::ParseTree::Node *, size_t) {
+          auto frame = frames.back();
+          frames.pop_back();
+          PrintNode(out, node.value_, node.children_.size(), layouts,
+                    index++, frame, frames);
+        },
+        [](const Parser::ParseTree::Node &, size_t) {},
+        [](const Parser::ParseTree::Node &, const Parser::ParseTree::Node *,
+           size_t) {});
+
+    out << "</svg>";
+  }
+
+  static String ToString(const Formula &formula) {
+    std::stringstream out;
+    Print(formula, out);
+    return out.str();
+  }
+
+ private:
+  // Box of a subtree in pre-order, brackets included. Sizes are in pixels,
+  // the baseline splits the height into ascent and descent.
+  struct Layout {
+    double scale_ = 1;
+    bool braced_ = false;
+    size_t size_ = 1;
+    double width_ = 0;
+    double ascent_ = 0;
+    double descent_ = 0;
+  };
+
+  struct Frame {
+    double x_;
+    double baseline_;
+  };
+
+  static const char *Symbol(int type) {
+    switch (type) {
+      case Parser::BaseTokenTypes::MINUS:
+        return "\u2212";
+      case Parser::BaseTokenTypes::MULT:
+        return "\u00B7";
+      case Parser::BaseTokenTypes::LOG:
+        return "ln";
+      case Parser::BaseTokenTypes::SIN:
+        return "sin";
+      case Parser::BaseTokenTypes::COS:
+        return "cos";
+      default:
+        return "+";
+    }
+  }
+
+  static double TextWidth(const String &text, double font_size) {
+    size_t glyphs = 0;
+    for (char symbol : text) {
+      glyphs += (symbol & 0xC0) != 0x80;
+    }
+    return glyphs * kGlyphWidth * font_size;
+  }
+
+  // Pre-order boxes computed bottom-up in one Euler tour.
+  static Vector<Layout> Measure(const Formula &formula) {
+    Vector<Layout> layouts;
+    Vector<size_t> open;
+    formula.GetTree().Traverse(
+        [&](const Parser::ParseTree::Node &node,
+            const Parser::ParseTree::Node *parent, size_t id) {
+          Layout layout;
+          if (parent != nullptr) {
+            layout.scale_ = layouts[open.back()].scale_;
+            if (parent->value_.Type() == Parser::BaseTokenTypes::POW &&
+                id == 1) {
+              layout.scale_ *= kScriptScale;
+            }
+            layout.braced_ =
+                Formula::NeedsLaTeXBraces(parent->value_, node.value_, id);
+          }
+          open.push_back(layouts.size());
+          layouts.push_back(layout);
+        },
+        [](const Parser::ParseTree::Node &, size_t) {},
+        [&](const Parser::ParseTree::Node &node,
+            const Parser::ParseTree::Node *, size_t) {
+          size_t index = open.back();
+          open.pop_back();
+          layouts[index].size_ = layouts.size() - index;
+          MeasureNode(node.value_, node.children_.size(), layouts, index);
+        });
+    return layouts;
+  }
+
+  static void MeasureNode(Parser::TokenRef token, size_t operands_number,
+                          Vector<Layout> &layouts, size_t index) {
+    auto &layout = layouts[index];
+    double font_size = kFontSize * layout.scale_;
+    layout.ascent_ = kAscent * font_size;
+    layout.descent_ = kDescent * font_size;
+
+    if (operands_number == 0) {
+      layout.width_ = TextWidth(token.ToString(), font_size);
+    } else if (token.Info().is_function_) {
+      const auto &arg = layouts[index + 1];
+      layout.width_ = TextWidth(Symbol(token.Type()), font_size) +
+                      kGap * font_size + 2 * kBraceWidth * font_size +
+                      arg.width_;
+      layout.ascent_ = std::max(layout.ascent_, arg.ascent_);
+      layout.descent_ = std::max(layout.descent_, arg.descent_);
+    } else {
+      const auto &left = layouts[index + 1];
+      const auto &right = layouts[index + 1 + left.size_];
+      switch (token.Type()) {
+        case Parser::BaseTokenTypes::DIV: {
+          double axis = kAxis * font_size;
+          double gap = kGap * font_size;
+          layout.width_ = std::max(left.width_, right.width_) + 2 * gap;
+          layout.ascent_ = axis + gap + left.descent_ + left.ascent_;
+          layout.descent_ = right.ascent_ + right.descent_ + gap - axis;
+        } break;
+
+        case Parser::BaseTokenTypes::POW: {
+          double raise = kRaise * font_size;
+          layout.width_ = left.width_ + right.width_;
+          layout.ascent_ = std::max(left.ascent_, raise + right.ascent_);
+          layout.descent_ = std::max(left.descent_, right.descent_ - raise);
+        } break;
+
+        default: {
+          double symbol_width = TextWidth(Symbol(token.Type()), font_size) +
+                                2 * kGap * font_size;
+          layout.width_ = -symbol_width;
+          layout.ascent_ = 0;
+          layout.descent_ = 0;
+          for (size_t i = 0, child = index + 1; i < operands_number; ++i) {
+            const auto &operand = layouts[child];
+            layout.width_ += symbol_width + operand.width_;
+            layout.ascent_ = std::max(layout.ascent_, operand.ascent_);
+            layout.descent_ = std::max(layout.descent_, operand.descent_);
+            child += operand.size_;
+          }
+        }
+      }
+    }
+
+    if (layout.braced_) {
+      layout.width_ += 2 * kBraceWidth * font_size;
+    }
+  }
+
+  // Draws one node at frame and pushes the frames of its children in reverse
+  // order, so the next entered child finds its own frame on top.
+  static void PrintNode(std::ostream &out, Parser::TokenRef token,
+                        size_t operands_number, const Vector<Layout> &layouts,
+                        size_t index, Frame frame, Vector<Frame> &frames) {
+    const auto &layout = layouts[index];
+    double font_size = kFontSize * layout.scale_;
+    double x = frame.x_;
+    double y = frame.baseline_;
+
+    if (layout.braced_) {
+      double brace_width = kBraceWidth * font_size;
+      PrintBrace(out, x, y, layout.ascent_, layout.descent_, brace_width,
+                 font_size, false);
+      PrintBrace(out, x + layout.width_ - brace_width, y, layout.ascent_,
+                 layout.descent_, brace_width, font_size, true);
+      x += brace_width;
+    }
+
+    if (operands_number == 0) {
+      PrintText(out, token.ToString(), x, y, font_size,
+                token.Type() == Parser::BaseTokenTypes::VARIABLE);
+      return;
+    }
+
+    if (token.Info().is_function_) {
+      const auto &arg = layouts[index + 1];
+      double brace_width = kBraceWidth * font_size;
+      PrintText(out, Symbol(token.Type()), x, y, font_size, false);
+      x += TextWidth(Symbol(token.Type()), font_size) + kGap * font_size;
+      PrintBrace(out, x, y, arg.ascent_, arg.descent_, brace_width, font_size,
+                 false);
+      PrintBrace(out, x + brace_width + arg.width_, y, arg.ascent_,
+                 arg.descent_, brace_width, font_size, true);
+      frames.push_back({x + brace_width, y});
+      return;
+    }
+
+    const auto &left = layouts[index + 1];
+    const auto &right = layouts[index + 1 + left.size_];
+    switch (token.Type()) {
+      case Parser::BaseTokenTypes::DIV: {
+        double axis = kAxis * font_size;
+        double gap = kGap * font_size;
+        double width = std::max(left.width_, right.width_) + 2 * gap;
+        out << "<line x1=\"" << x + gap / 2 << "\" y1=\"" << y - axis
+            << "\" x2=\"" << x + width - gap / 2 << "\" y2=\"" << y - axis
+            << "\" stroke=\"black\" stroke-width=\""
+            << kStrokeWidth * font_size << "\"/>";
+        frames.push_back({x + (width - right.width_) / 2,
+                          y - axis + gap + right.ascent_});
+        frames.push_back({x + (width - left.width_) / 2,
+                          y - axis - gap - left.descent_});
+      } break;
+
+      case Parser::BaseTokenTypes::POW: {
+        frames.push_back({x + left.width_, y - kRaise * font_size});
+        frames.push_back({x, y});
+      } break;
+
+      default: {
+        Vector<Frame> operands;
+        for (size_t i = 0, child = index + 1; i < operands_number; ++i) {
+          if (i > 0) {
+            x += kGap * font_size;
+            PrintText(out, Symbol(token.Type()), x, y, font_size, false);
+            x += TextWidth(Symbol(token.Type()), font_size) + kGap * font_size;
+          }
+          operands.push_back({x, y});
+          x += layouts[child].width_;
+          child += layouts[child].size_;
+        }
+        while (!operands.empty()) {
+          frames.push_back(operands.back());
+          operands.pop_back();
+        }
+      }
+    }
+  }
+
+  static void PrintText(std::ostream &out, const String &text, double x,
+                        double y, double font_size, bool italic) {
+    out << "<text x=\"" << x << "\" y=\"" << y << "\" font-size=\""
+        << font_size << "\"" << (italic ? " font-style=\"italic\"" : "")
+        << ">" << text << "</text>";
+  }
+
+  static void PrintBrace(std::ostream &out, double x, double y, double ascent,
+                         double descent, double width, double font_size,
+                         bool closing) {
+    double outer = closing ? x + 0.2 * width : x + 0.8 * width;
+    double inner = closing ? x + 0.9 * width : x + 0.1 * width;
+    out << "<path d=\"M" << outer << " " << y - ascent << " Q" << inner << " "
+        << y + (descent - ascent) / 2 << " " << outer << " " << y + descent
+        << "\" fill=\"none\" stroke=\"black\" stroke-width=\""
+        << kStrokeWidth * font_size << "\"/>";
+  }
+
+  static constexpr double kFontSize = 20;
+  static constexpr double kMargin = 4;
+  static constexpr double kGlyphWidth = 0.55;
+  static constexpr double kAscent = 0.72;
+  static constexpr double kDescent = 0.24;
+  static constexpr double kAxis = 0.3;
+  static constexpr double kRaise = 0.45;
+  static constexpr double kGap = 0.15;
+  static constexpr double kBraceWidth = 0.35;
+  static constexpr double kScriptScale = 0.7;
+  static constexpr double kStrokeWidth = 0.06;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 
@@ -17,9 +18,36 @@ class Tree {
     }
     explicit Node(T value) : value_(std::move(value)){};
     Node() = default;
+    Node(const Node &) = delete;
+    Node &operator=(const Node &) = delete;
+
+    // Releasing the root of a deep tree would otherwise recurse once per
+    // level through the shared_ptr destructors. Descendants owned only by
+    // this node are detached onto an explicit stack and released one by one;
+    // shared ones are only unreferenced.
+    ~Node() {
+      Vector<Ptr> released;
+      MoveChildren(released);
+      while (!released.empty()) {
+        Ptr node = std::move(released.back());
+        released.pop_back();
+        if (node.use_count() == 1) {
+          node->MoveChildren(released);
+        }
+      }
+    }
+
     std::weak_ptr<Node> parent_;
     Vector<Ptr> children_;
     T value_;
+
+   private:
+    void MoveChildren(Vector<Ptr> &out) {
+      while (!children_.empty()) {
+        out.push_back(std::move(children_.back()));
+        children_.pop_back();
+      }
+    }
   };
 
   class PostOrderIterator {
@@ -82,22 +110,11 @@ class Tree {
 
    private:
     friend Tree<T>;
-    explicit PostOrderIterator(const Tree<T> *owner, typename Node::Ptr node)
-        : owner_(owner), node_(std::move(node)) {
-      GetLocation(location_, node_);
-    }
-
-    void GetLocation(Vector<size_t> &location, typename Node::Ptr node) {
-      if (owner_->IsRoot(node)) {
-        return;
-      }
-
-      auto parent = node->parent_.lock();
-
-      GetLocation(location_, parent);
-
-      location_.push_back(owner_->GetId(node));
-    }
+    PostOrderIterator(const Tree<T> *owner, typename Node::Ptr node,
+                      Vector<size_t> location)
+        : node_(std::move(node)),
+          location_(std::move(location)),
+          owner_(owner) {}
 
     bool IsEnd() const { return node_ == nullptr; }
 
@@ -115,7 +132,7 @@ class Tree {
       std::function<void(const typename Tree<D>::PostOrderIterator &,
                          typename Tree<T>::PostOrderIterator &)>
           func) {
-    auto new_tree = Tree<T>(CreateLikeNode<D>(model.GetRoot()));
+    auto new_tree = Tree<T>(CreateLikeNode<D>(model));
 
     auto new_tree_iter = new_tree.begin();
     for (auto &&model_iter = model.begin(); model_iter != model.end();
@@ -128,10 +145,18 @@ class Tree {
   }
 
   Tree<T> Replace(typename Node::Ptr old_node, typename Node::Ptr new_node) {
+    size_t id = IsRoot(old_node) ? 0 : GetId(old_node);
+    return Replace(std::move(old_node), std::move(new_node), id);
+  }
+
+  // id is the position of old_node among the children of its parent, so the
+  // parent is not searched for it.
+  Tree<T> Replace(typename Node::Ptr old_node, typename Node::Ptr new_node,
+                  size_t id) {
     if (!IsRoot(old_node)) {
       auto parent = old_node->parent_.lock();
       new_node->parent_ = parent;
-      parent->children_[GetId(old_node)] = std::move(new_node);
+      parent->children_[id] = std::move(new_node);
       old_node->parent_ = std::weak_ptr<Node>();
     } else {
       root_ = new_node;
@@ -153,7 +178,8 @@ class Tree {
   Tree<T> Replace(PostOrderIterator &old_iter, typename Node::Ptr new_node) {
     auto old_node = old_iter.node_;
     old_iter.node_ = new_node;
-    return Replace(std::move(old_node), std::move(new_node));
+    size_t id = old_iter.location_.empty() ? 0 : old_iter.location_.back();
+    return Replace(std::move(old_node), std::move(new_node), id);
   }
 
   Tree<T> ExtractSubTree(PostOrderIterator &iter) {
@@ -170,32 +196,174 @@ class Tree {
     return node == root_;
   }
 
+  // Euler tour without recursion: parent links are followed on the way up,
+  // and the positions of the nodes on the path are kept on a stack, so wide
+  // parents are not searched for the child being left. enter(node, parent, id)
+  // is called before the children of a node, between(node, id) after its id-th
+  // child when another one follows, leave(node, parent, id) after all of them.
+  // parent is null for the root.
+  template <class Enter, class Between, class Leave>
+  void Traverse(Enter enter, Between between, Leave leave) const {
+    if (root_ == nullptr) {
+      return;
+    }
+
+    const Node *node = root_.get();
+    const Node *parent = nullptr;
+    size_t id = 0;
+    Vector<size_t> ids;
+    enter(*node, parent, id);
+    while (true) {
+      if (!node->children_.empty()) {
+        parent = node;
+        node = node->children_[0].get();
+        ids.push_back(id);
+        id = 0;
+        enter(*node, parent, id);
+        continue;
+      }
+
+      while (true) {
+        leave(*node, parent, id);
+        if (parent == nullptr) {
+          return;
+        }
+
+        if (id + 1 < parent->children_.size()) {
+          between(*parent, id);
+          node = parent->children_[++id].get();
+          enter(*node, parent, id);
+          break;
+        }
+
+        node = parent;
+        parent = IsRoot(node) ? nullptr : node->parent_.lock().get();
+        id = ids.back();
+        ids.pop_back();
+      }
+    }
+  }
+
+  // A piece of the tree cut by Split.
+  struct Part {
+    typename Node::Ptr node_;
+    // The whole subtree of node_ is one task; otherwise node_ alone joins the
+    // parts under it.
+    bool is_task_;
+    // Position of node_ among the children of its parent.
+    size_t id_;
+    // Number of nodes in the subtree of node_.
+    size_t size_;
+    // The batch of a task: consecutive tasks share one until they hold about
+    // threshold nodes, so the many small children of a wide node make a few
+    // pool tasks instead of one each.
+    size_t batch_;
+  };
+
+  // Cuts the tree for fork-join processing: subtrees of fewer than threshold
+  // nodes under larger parents are independent tasks, and the larger nodes
+  // above them are joins. Parts come in post-order of the cut tree, so every
+  // join follows the parts under it.
+  Vector<Part> Split(size_t threshold) const {
+    Vector<Part> parts;
+    // Sizes of the subtrees whose parents are not reached yet.
+    Vector<size_t> sizes;
+    for (auto &&node = begin(); node != end(); ++node) {
+      size_t size = 1;
+      for (size_t i = 0; i < node->children_.size(); ++i) {
+        size += sizes.back();
+        sizes.pop_back();
+      }
+      sizes.push_back(size);
+
+      // A small subtree stays a task until its parent turns out small too;
+      // its children are then the last parts and make way for it.
+      bool is_task = size < threshold;
+      if (is_task) {
+        for (size_t i = 0; i < node->children_.size(); ++i) {
+          parts.pop_back();
+        }
+      }
+      parts.push_back({node.node_, is_task,
+                       node.location_.empty() ? 0 : node.location_.back(),
+                       size, 0});
+    }
+
+    size_t batch = 0;
+    size_t batch_size = 0;
+    for (auto &part : parts) {
+      if (!part.is_task_) {
+        continue;
+      }
+      if (batch_size >= threshold) {
+        ++batch;
+        batch_size = 0;
+      }
+      part.batch_ = batch;
+      batch_size += part.size_;
+    }
+    return parts;
+  }
+
+  // The indices of the task parts in order, and where each batch starts among
+  // them; the last entry of batches is the number of tasks.
+  static void CollectTasks(const Vector<Part> &parts, Vector<size_t> &tasks,
+                           Vector<size_t> &batches) {
+    for (size_t i = 0; i < parts.size(); ++i) {
+      if (!parts[i].is_task_) {
+        continue;
+      }
+      if (tasks.empty() || parts[tasks.back()].batch_ != parts[i].batch_) {
+        batches.push_back(tasks.size());
+      }
+      tasks.push_back(i);
+    }
+    batches.push_back(tasks.size());
+  }
+
+  // The first node is the leftmost leaf; its location is all zeros.
   PostOrderIterator begin() const {
     auto node = root_;
+    Vector<size_t> location;
     while (!node->children_.empty()) {
       node = node->children_[0];
+      location.push_back(0);
     }
-    return PostOrderIterator(this, node);
+    return PostOrderIterator(this, node, std::move(location));
   }
 
-  PostOrderIterator end() const { return ++PostOrderIterator(this, root_); }
+  PostOrderIterator end() const {
+    return PostOrderIterator(this, nullptr, Vector<size_t>());
+  }
 
  private:
+  // Builds the shape of model in post-order: the children of a node are the
+  // last nodes on the stack when it is reached.
   template <class D>
-  static typename Tree<T>::Node::Ptr CreateLikeNode(
-      const typename Tree<D>::Node::Ptr &model) {
-    if (model == nullptr) {
+  static typename Tree<T>::Node::Ptr CreateLikeNode(const Tree<D> &model) {
+    if (model.GetRoot() == nullptr) {
       return nullptr;
     }
 
-    auto node = std::make_shared<Tree<T>::Node>();
-    for (const typename Tree<D>::Node::Ptr &child : model->children_) {
-      Tree<T>::Node::Attach(node, CreateLikeNode<D>(child));
+    Vector<typename Tree<T>::Node::Ptr> stack;
+    for (auto &&model_iter = model.begin(); model_iter != model.end();
+         ++model_iter) {
+      auto node = std::make_shared<Tree<T>::Node>();
+      size_t children_number = model_iter->children_.size();
+      for (size_t i = stack.size() - children_number; i < stack.size(); ++i) {
+        Tree<T>::Node::Attach(node, std::move(stack[i]));
+      }
+      for (size_t i = 0; i < children_number; ++i) {
+        stack.pop_back();
+      }
+      stack.push_back(std::move(node));
     }
 
-    return node;
+    return stack.back();
   }
 
+  bool IsRoot(const Node *node) const { return node == root_.get(); }
+
   int GetId(const typename Node::Ptr &node) const {
     auto parent = node->parent_.lock();
     for (size_t i = 0; i < parent->children_.size(); ++i) {
@@ -158,6 +158,17 @@ class SimpleUnorderedMap {
         typename List<std::pair<const Key, Value>>::ConstIterator());
   }
 
+  size_t erase(const Key &item) {
+    if (data_.empty() ||
+        !FindTitle(item)->RemoveFirst(
+            [&item](const auto &pair) { return pair.first == item; })) {
+      return 0;
+    }
+
+    --size_;
+    return 1;
+  }
+
   size_t size() const { return size_; }
 
  private:
@@ -0,0 +1 @@
+#include "VariableSet.h"
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+
+#include "../Vector/Vector.h"
+
+// Set of variable ids (Token::symbol_id_) kept as a bitset. Sets of formulas
+// with fewer than 64 variables take one word.
+class VariableSet {
+ public:
+  VariableSet() = default;
+
+  void Insert(size_t id) {
+    if (id / kWordBits >= words_.size()) {
+      words_.resize(id / kWordBits + 1);
+    }
+    words_[id / kWordBits] |= uint64_t(1) << (id % kWordBits);
+  }
+
+  bool Contains(size_t id) const {
+    return id / kWordBits < words_.size() &&
+           (words_[id / kWordBits] >> (id % kWordBits) & 1) != 0;
+  }
+
+  bool Empty() const {
+    for (auto word : words_) {
+      if (word != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Merge(const VariableSet &other) {
+    if (other.words_.size() > words_.size()) {
+      words_.resize(other.words_.size());
+    }
+    for (size_t i = 0; i < other.words_.size(); ++i) {
+      words_[i] |= other.words_[i];
+    }
+  }
+
+ private:
+  static const size_t kWordBits = 64;
+
+  Vector<uint64_t> words_;
+};
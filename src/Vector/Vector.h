@@ -22,7 +22,12 @@ class SimpleVector {
   explicit SimpleVector(size_t n) { resize(n); }
 
   SimpleVector(const SimpleVector &another) {
-    CopyFromRange(another.b_, another.e_);
+    CopyFromRange(another.b_, another.c_);
+  }
+
+  SimpleVector(SimpleVector &&another) noexcept
+      : b_(another.b_), e_(another.e_), c_(another.c_) {
+    another.b_ = another.e_ = another.c_ = nullptr;
   }
 
   template <class InputIterator>
@@ -159,9 +164,11 @@ class SimpleVector {
     c_ = new_c;
   }
 
-  T *Allocate(size_t n) { return (T *)malloc(n * sizeof(T)); }
+  T *Allocate(size_t n) {
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
 
-  void DeAllocate() { free(b_); }
+  void DeAllocate() { ::operator delete(b_); }
 
   template <class Iterator>
   void CopyFromRange(const Iterator &b, const Iterator &e) {
@@ -32,9 +32,33 @@ void Dialog(const Formula& formula) {
 }
 
 int main(int argc, char** argv) {
+  bool print_stats = false;
+  Vector<std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) == "--stats") {
+      print_stats = true;
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+
   Differentiator differentiator;
-  auto formula = differentiator.Differentiate(argv[1], argv[2]);
-  formula.ToPDF(argv[3]);
+  if (print_stats) {
+    auto [formula, stats] =
+        differentiator.DifferentiateWithStats(args[0], args[1]);
+    if (!formula.ToPDF(args[2], &stats)) {
+      std::cerr << "Unable to write " << args[2] << std::endl;
+    }
+    std::cout << formula.ToString() << std::endl;
+    std::cout << stats.ToJSON() << std::endl;
+    Dialog(formula);
+    return 0;
+  }
+
+  auto formula = differentiator.Differentiate(args[0], args[1]);
+  if (!formula.ToPDF(args[2])) {
+    std::cerr << "Unable to write " << args[2] << std::endl;
+  }
   std::cout << formula.ToString() << std::endl;
   Dialog(formula);
   return 0;
@@ -1,4 +1,16 @@
 #include <Differentiator.h>
+#include <DerivativeCache.h>
+#include <ForkJoinPool.h>
+#include <FormulaStore.h>
+#include <IncrementalFormula.h>
+#include <JitFormula.h>
+#include <LazyDerivative.h>
+#include <NativeFormula.h>
+#include <RenderPool.h>
+#include <StaticFormula.h>
+#include <SvgRenderer.h>
+#include <thread>
+
 #include "gtest/gtest.h"
 
 class Tests : public ::testing::Test {
@@ -90,4 +102,708 @@ TEST_F(Tests, Test_6) {
                                       .ToString())),
               std::abs(0.0001 * std::stold(answers[i])));
   }
-}
\ No newline at end of file
+}
+
+TEST_F(Tests, Test_7) {
+  expr_ = "x*y*y + z";
+  Vector<String> answers = {"2", "8", "24.2", "247.0468", "2326279.826"};
+  for (size_t i = 0; i < Tests::kPoints; ++i) {
+    EXPECT_LE(std::abs(std::stold(answers[i]) -
+                       std::stold(differentiator_.Differentiate(expr_, "y")
+                                      .At(variables_[i])
+                                      .ToString())),
+              std::abs(0.00001 * std::stold(answers[i])));
+    EXPECT_EQ(0, std::stold(differentiator_.Differentiate(expr_, "w")
+                                .At(variables_[i])
+                                .ToString()));
+  }
+}
+
+TEST_F(Tests, Test_8) {
+  expr_ = "log(x^cos(x)*y^sin(x)) + (y+x) * (z - x / (z + x)) * x";
+  auto derivative = differentiator_.Differentiate(expr_, "x");
+  for (size_t i = 0; i < Tests::kPoints; ++i) {
+    UnorderedMap<String, long double> values = {
+        {"x", std::stold(variables_[i].find("x")->second)},
+        {"y", std::stold(variables_[i].find("y")->second)},
+        {"z", std::stold(variables_[i].find("z")->second)}};
+    auto expected = std::stold(derivative.At(variables_[i]).ToString());
+    EXPECT_LE(std::abs(expected - derivative.Evaluate(values)),
+              std::abs(0.00001 * expected));
+  }
+}
+
+TEST_F(Tests, Test_9) {
+  expr_ = "x^3 * 1/3 + 2^10 * (y - y)";
+  UnorderedMap<String, String> point = {{"x", "0.5"}, {"y", "7"}};
+  EXPECT_EQ("0.25",
+            differentiator_.Differentiate(expr_, "x").At(point).ToString());
+  EXPECT_EQ("0",
+            differentiator_.Differentiate(expr_, "y").At(point).ToString());
+}
+
+TEST_F(Tests, Test_10) {
+  auto [formula, stats] = differentiator_.DifferentiateWithStats("x*x*1", "x");
+  ASSERT_EQ(4, stats.phases_.size());
+  EXPECT_STREQ("parse", stats.phases_[0].name_);
+  EXPECT_STREQ("optimize", stats.phases_[3].name_);
+  EXPECT_LT(0, stats.phases_[0].allocations_);
+  EXPECT_EQ(formula.Size(), stats.nodes_after_optimize_);
+  EXPECT_LT(stats.nodes_after_optimize_, stats.nodes_before_optimize_);
+}
+
+TEST_F(Tests, Test_11) {
+  Vector<String> expressions = {"x-(y+z)", "x/(y*z)",     "(x*y)^z",
+                                "x^(y^z)", "2*(x+1)-y/2", "log(x+y)*sin(x)"};
+  for (const auto &expr : expressions) {
+    EXPECT_EQ(expr, Formula(expr).ToString());
+  }
+}
+
+TEST_F(Tests, Test_12) {
+  EXPECT_EQ("\\left(x*y\\right)^{z}", Formula("(x*y)^z").GetLaTeX());
+  EXPECT_EQ("\\frac{x+1}{x-1}-x^{2}", Formula("(x+1)/(x-1)-x^2").GetLaTeX());
+  EXPECT_EQ("\\ln{\\left(x-\\left(y+z\\right)\\right)}",
+            Formula("log(x-(y+z))").GetLaTeX());
+}
+
+TEST_F(Tests, Test_13) {
+  String info;
+  auto pdf = Formula("x^2").ToPDFBytes(&info);
+  if (pdf) {
+    EXPECT_EQ("%PDF", pdf->substr(0, 4));
+  } else {
+    EXPECT_FALSE(info.empty());
+  }
+  EXPECT_FALSE(std::ifstream("tmp.tex").good());
+}
+
+TEST_F(Tests, Test_14) {
+  bool has_tex = Formula("x").ToPDFBytes().has_value();
+  RenderPool pool(2);
+  Vector<std::future<std::optional<String>>> results;
+  for (const auto &expr : {"x", "x^2", "sin(x)/x", "log(x*y)"}) {
+    results.push_back(pool.Render(differentiator_.Differentiate(expr, "x")));
+  }
+  for (auto &result : results) {
+    auto pdf = result.get();
+    ASSERT_EQ(has_tex, pdf.has_value());
+    if (pdf) {
+      EXPECT_EQ("%PDF", pdf->substr(0, 4));
+    }
+  }
+}
+
+TEST_F(Tests, Test_15) {
+  auto svg = SvgRenderer::ToString(Formula("(x+1)*y/z^2"));
+  EXPECT_EQ("<svg", svg.substr(0, 4));
+  EXPECT_EQ("</svg>", svg.substr(svg.size() - 6));
+  EXPECT_NE(String::npos, svg.find("<line"));
+  EXPECT_NE(String::npos, svg.find("<path"));
+  EXPECT_NE(String::npos, svg.find(">x</text>"));
+  EXPECT_EQ(String::npos,
+            SvgRenderer::ToString(Formula("x*y")).find("<path"));
+}
+
+TEST_F(Tests, Test_16) {
+  DerivativeCache cache(1 << 20);
+  auto first = cache.Differentiate("x * sin(x)", "x");
+  auto second = cache.Differentiate("x*sin( x )", "x");
+  EXPECT_EQ(first, second);
+  EXPECT_NE(first, cache.Differentiate("x*sin(x)", "y"));
+  EXPECT_EQ(1, cache.Hits());
+  EXPECT_EQ(2, cache.Misses());
+  EXPECT_EQ(differentiator_.Differentiate("x*sin(x)", "x").ToString(),
+            first->ToString());
+
+  DerivativeCache single(1 << 20);
+  single.Differentiate("x*sin(x)", "x");
+  DerivativeCache small(single.Bytes());
+  small.Differentiate("x*sin(x)", "x");
+  small.Differentiate("y*sin(y)", "y");
+  small.Differentiate("y*sin(y)", "y");
+  EXPECT_EQ(1, small.Size());
+  EXPECT_EQ(1, small.Evictions());
+  EXPECT_EQ(1, small.Hits());
+}
+
+TEST_F(Tests, Test_17) {
+  auto formula = differentiator_.Differentiate("x^y/3 + sin(z*x)", "x");
+  std::stringstream out;
+  formula.Serialize(out, "label");
+  auto data = out.str();
+  auto loaded = Formula::Deserialize(data.data(), data.size(), "label");
+  ASSERT_TRUE(loaded.has_value());
+  EXPECT_EQ(formula.ToString(), loaded->ToString());
+  EXPECT_EQ(formula.At(variables_[2]).ToString(),
+            loaded->At(variables_[2]).ToString());
+  EXPECT_FALSE(Formula::Deserialize(data.data(), data.size(), "other"));
+  EXPECT_FALSE(Formula::Deserialize(data.data(), data.size() - 1, "label"));
+
+  // The index above the type byte is kept in full, not wrapped at 2^24.
+  std::stringstream variable;
+  Formula("x").Serialize(variable);
+  data = variable.str();
+  EXPECT_TRUE(Formula::Deserialize(data.data(), data.size()));
+  uint64_t opcode = Parser::BaseTokenTypes::VARIABLE | uint64_t(1) << 32;
+  std::memcpy(&data[data.size() - sizeof(opcode)], &opcode, sizeof(opcode));
+  EXPECT_FALSE(Formula::Deserialize(data.data(), data.size()));
+  data = variable.str();
+  data[sizeof(uint32_t)] = 1;
+  EXPECT_FALSE(Formula::Deserialize(data.data(), data.size()));
+
+  char directory[] = "/tmp/formula-store-XXXXXX";
+  ASSERT_NE(nullptr, mkdtemp(directory));
+  FormulaStore store(directory);
+  auto computed = store.Differentiate("x*log(x)", "x");
+  auto restored = FormulaStore(directory).Load("x * log(x)", "x");
+  ASSERT_TRUE(restored.has_value());
+  EXPECT_EQ(computed.ToString(), restored->ToString());
+  EXPECT_EQ(1, store.Misses());
+  std::filesystem::remove_all(directory);
+}
+
+TEST_F(Tests, Test_18) {
+  Vector<String> expressions = {"x^3 - 2*x*y + sin(x*y)", "log(x)/cos(y)",
+                                "x^y + (x-y)^2", "sin(x)*cos(x) - x/10"};
+  UnorderedMap<String, Interval> box = {{"x", Interval(0.5, 2)},
+                                        {"y", Interval(-1, 1.5)}};
+  for (const auto &expr : expressions) {
+    for (const auto &formula :
+         {Formula(expr), differentiator_.Differentiate(expr, "x")}) {
+      auto enclosure = formula.Enclose(box);
+      for (int i = 0; i <= 20; ++i) {
+        for (int j = 0; j <= 20; ++j) {
+          long double value = formula.Evaluate(
+              {{"x", 0.5 + 1.5 * i / 20}, {"y", -1 + 2.5 * j / 20}});
+          EXPECT_TRUE(enclosure.Contains(value)) << expr;
+        }
+      }
+    }
+  }
+
+  auto derivative = differentiator_.Differentiate("x^2 + sin(x)", "x");
+  EXPECT_FALSE(derivative.Enclose({{"x", Interval(1, 2)}}).Contains(0));
+  auto sine = Formula("sin(x)").Enclose({{"x", Interval(0, 7)}});
+  EXPECT_EQ(-1, sine.GetLower());
+  EXPECT_EQ(1, sine.GetUpper());
+  EXPECT_TRUE(Formula("log(x)").Enclose({{"x", Interval(-2, -1)}}).IsEmpty());
+}
+
+TEST_F(Tests, Test_19) {
+  auto derivative =
+      differentiator_.Differentiate("x^3*sin(x*y) + log(x*y)/(x*y)", "x");
+  EXPECT_NE(String::npos, derivative.EmitC("f").find("double f("));
+
+  NativeFormula native(derivative);
+  Vector<double> points;
+  for (const auto &point : variables_) {
+    Vector<double> values(native.ValuesNumber());
+    for (const auto &name : {"x", "y", "z"}) {
+      if (auto id = Formula::FindVariable(name); id && *id < values.size()) {
+        values[id.value()] = std::stod(point.find(name)->second);
+      }
+    }
+    for (auto value : values) {
+      points.push_back(value);
+    }
+  }
+
+  size_t count = variables_.size();
+  Vector<double> results(count);
+  native.Evaluate(points.begin(), count, native.ValuesNumber(),
+                  results.begin());
+  for (size_t i = 0; i < count; ++i) {
+    long double expected =
+        std::stold(derivative.At(variables_[i]).ToString());
+    EXPECT_NEAR(1, results[i] / expected, 1e-5);
+    EXPECT_EQ(results[i],
+              native.Evaluate(points.begin() + i * native.ValuesNumber()));
+  }
+}
+
+TEST_F(Tests, Test_20) {
+  Vector<String> expressions = {
+      "x*x/2",
+      "(y*z*x) * (1 + 2 + 3) + x*x*x*x + (y+x) * (z - x / (z + x)) * x",
+      "(x + y) / (x + z) + (x + z) / (x + y)",
+      "x^3 + log(x*z) - sin(x)/cos(y)"};
+  for (const auto &expr : expressions) {
+    auto derivative = differentiator_.Differentiate(expr, "x");
+    JitFormula jit(derivative);
+#if defined(__x86_64__)
+    EXPECT_TRUE(jit.IsCompiled());
+#endif
+
+    size_t stride = std::max<size_t>(jit.ValuesNumber(), 1);
+    Vector<double> points(variables_.size() * stride);
+    for (size_t i = 0; i < variables_.size(); ++i) {
+      for (const auto &name : {"x", "y", "z"}) {
+        auto id = Formula::FindVariable(name);
+        if (id && *id < stride) {
+          points[i * stride + *id] =
+              std::stod(variables_[i].find(name)->second);
+        }
+      }
+    }
+
+    Vector<double> results(variables_.size());
+    jit.Evaluate(points.begin(), variables_.size(), stride, results.begin());
+    for (size_t i = 0; i < variables_.size(); ++i) {
+      long double expected =
+          std::stold(derivative.At(variables_[i]).ToString());
+      EXPECT_NEAR(expected, results[i], 1e-5 * std::abs(expected)) << expr;
+      EXPECT_EQ(results[i], jit.Evaluate(points.begin() + i * stride));
+    }
+  }
+}
+
+TEST_F(Tests, Test_21) {
+  using X = StaticFormula::Var<'x'>;
+  using Y = StaticFormula::Var<'y'>;
+  using Cube = StaticFormula::Pow<X, StaticFormula::Const<3>>;
+  using Square = StaticFormula::Mul<X, X>;
+
+  static_assert(std::is_same_v<StaticFormula::Derivative<Square, 'x'>,
+                               StaticFormula::Add<X, X>>);
+  static_assert(std::is_same_v<
+                StaticFormula::Derivative<Cube, 'x'>,
+                StaticFormula::Mul<StaticFormula::Const<3>,
+                                   StaticFormula::Pow<
+                                       X, StaticFormula::Const<2>>>>);
+  static_assert(std::is_same_v<StaticFormula::Derivative<Cube, 'y'>,
+                               StaticFormula::Const<0>>);
+  static_assert(StaticFormula::Derivative<Cube, 'x'>::Evaluate(
+                    StaticFormula::Point({{'x', 2}})) == 12);
+  static_assert(StaticFormula::Derivative<StaticFormula::Mul<Square, Y>,
+                                          'x'>::Evaluate(
+                    StaticFormula::Point({{'x', 3}, {'y', 5}})) == 30);
+
+  using Product = StaticFormula::Mul<StaticFormula::Sin<X>,
+                                     StaticFormula::Cos<X>>;
+  using Quotient = StaticFormula::Div<X, StaticFormula::Add<X, Y>>;
+  using Logarithm = StaticFormula::Log<StaticFormula::Mul<X, Y>>;
+  using Power = StaticFormula::Pow<X, StaticFormula::Sin<Y>>;
+  auto check = [this](auto expr, const String &text) {
+    using Expr = decltype(expr);
+    using Derivative = StaticFormula::Derivative<Expr, 'x'>;
+    EXPECT_EQ(Formula(StaticFormula::ToString<Expr>()).ToString(), text);
+    auto derivative = differentiator_.Differentiate(text, "x");
+    EXPECT_EQ(Formula(StaticFormula::ToString<Derivative>()).ToString(),
+              derivative.ToString());
+    for (const auto &point : variables_) {
+      auto values = StaticFormula::Point(
+          {{'x', std::stod(point.find("x")->second)},
+           {'y', std::stod(point.find("y")->second)}});
+      long double expected = std::stold(derivative.At(point).ToString());
+      EXPECT_NEAR(expected, Derivative::Evaluate(values),
+                  1e-5 * std::abs(expected))
+          << text;
+    }
+  };
+  check(Cube(), "x^3");
+  check(Product(), "sin(x)*cos(x)");
+  check(Quotient(), "x/(x+y)");
+  check(Logarithm(), "log(x*y)");
+  check(Power(), "x^sin(y)");
+}
+
+TEST_F(Tests, Test_22) {
+  auto [constant, constant_stats] = differentiator_.DifferentiateWithStats(
+      "y*z*sin(y)*cos(z)/log(z)", "x");
+  EXPECT_EQ(constant.ToString(), "0");
+  EXPECT_EQ(constant_stats.nodes_before_optimize_, 1);
+
+  auto [partial, partial_stats] =
+      differentiator_.DifferentiateWithStats("y*z*sin(y)*x", "x");
+  EXPECT_EQ(partial.ToString(), "y*z*sin(y)");
+  EXPECT_EQ(partial_stats.nodes_before_optimize_,
+            partial_stats.nodes_after_optimize_ + 2);
+
+  auto derivative =
+      differentiator_.Differentiate("(x/1000)^y + y^(x/1000) - z/x", "x");
+  for (const auto &point : variables_) {
+    long double x = std::stold(point.find("x")->second);
+    long double y = std::stold(point.find("y")->second);
+    long double z = std::stold(point.find("z")->second);
+    long double expected = y * powl(x / 1000, y - 1) / 1000 +
+                           powl(y, x / 1000) * logl(y) / 1000 + z / (x * x);
+    EXPECT_NEAR(expected, std::stold(derivative.At(point).ToString()),
+                1e-5 * std::abs(expected));
+  }
+}
+
+TEST_F(Tests, Test_23) {
+  Formula formula("x*y + sin(z)^2 + log(y)*cos(x) + z/3");
+  auto x = Formula::FindVariable("x").value();
+  auto y = Formula::FindVariable("y").value();
+  auto z = Formula::FindVariable("z").value();
+  Vector<long double> values(formula.ValuesNumber());
+  values[x] = 1;
+  values[y] = 2;
+  values[z] = 3;
+
+  IncrementalFormula incremental(formula, values);
+  EXPECT_EQ(incremental.Value(), formula.Evaluate(values));
+  EXPECT_EQ(incremental.Recomputed(), 0);
+
+  // z feeds sin(z)^2, z/3 and the three sums above them.
+  values[z] = 0.25;
+  incremental.Set(z, values[z]);
+  EXPECT_EQ(incremental.Value(), formula.Evaluate(values));
+  EXPECT_EQ(incremental.Recomputed(), 6);
+
+  values[x] = -4;
+  values[y] = 7;
+  incremental.Set("x", values[x]);
+  incremental.Set(y, values[y]);
+  EXPECT_EQ(incremental.Value(), formula.Evaluate(values));
+  EXPECT_LT(incremental.Recomputed(), 6 + incremental.Size());
+
+  incremental.Set("w", 1);
+  EXPECT_EQ(incremental.Value(), formula.Evaluate(values));
+}
+
+TEST_F(Tests, Test_24) {
+  auto check = [](const String &expr, const String &simplified) {
+    Formula formula(expr);
+    formula.Simplify();
+    EXPECT_EQ(formula.ToString(), simplified) << expr;
+  };
+  check("x*y+x*z", "x*(y+z)");
+  check("x+y-x", "y");
+  check("log(x)+log(y)-log(z)", "log(x*y/z)");
+  check("x^2*x^3", "x^5");
+  check("2*3+x*1", "6+x");
+
+  Vector<String> expressions = {"x^3*sin(x)/(x+y)", "log(x*y)*x^2",
+                                "cos(x)*sin(x)*x*y", "(x+1)*(x+1)/x"};
+  for (const auto &expr : expressions) {
+    auto derivative = differentiator_.Differentiate(expr, "x");
+    auto simplified = derivative;
+    simplified.Simplify();
+    EXPECT_LE(simplified.Cost(), derivative.Cost()) << expr;
+    for (const auto &point : variables_) {
+      long double expected = std::stold(derivative.At(point).ToString());
+      long double value = std::stold(simplified.At(point).ToString());
+      EXPECT_NEAR(expected, value, 1e-5 * std::abs(expected)) << expr;
+    }
+  }
+}
+
+TEST_F(Tests, Test_25) {
+  EXPECT_EQ(differentiator_.Differentiate("x^3", "x").ToString(), "3*x^2");
+  EXPECT_EQ(differentiator_.Differentiate("y^x", "x").ToString(),
+            "y^x*log(y)");
+  EXPECT_EQ(differentiator_.Differentiate("sin(x)^y", "x").ToString(),
+            "y*sin(x)^(y-1)*cos(x)");
+
+  // No log of the base appears, so negative bases work.
+  UnorderedMap<String, String> point = {{"x", "-3"}, {"y", "2"}};
+  EXPECT_EQ(std::stold(differentiator_.Differentiate("x^3-x^y", "x")
+                           .At(point)
+                           .ToString()),
+            33);
+}
+
+TEST_F(Tests, Test_26) {
+  String expr = "x*y + 2 + sin(z) + 3 + x*x*z*4";
+  for (size_t i = 0; i < 10; ++i) {
+    expr += " + x/" + std::to_string(i + 2);
+  }
+  Formula binary(expr);
+  Formula flat(expr);
+  flat.Flatten();
+  EXPECT_EQ(flat.ToString(), binary.ToString());
+  EXPECT_EQ(flat.GetTree().GetRoot()->children_.size(), 15);
+  EXPECT_LT(flat.Size(), binary.Size());
+  EXPECT_EQ(flat.Cost(), binary.Cost());
+
+  Vector<long double> values(flat.ValuesNumber());
+  values[Formula::FindVariable("x").value()] = 1.5;
+  values[Formula::FindVariable("y").value()] = -2;
+  values[Formula::FindVariable("z").value()] = 0.75;
+  long double expected = binary.Evaluate(values);
+  EXPECT_NEAR(flat.Evaluate(values), expected, 1e-12);
+  EXPECT_TRUE(flat.Enclose({{"x", Interval(1.5, 1.5)},
+                            {"y", Interval(-2, -2)},
+                            {"z", Interval(0.75, 0.75)}})
+                  .Contains(expected));
+  EXPECT_NEAR(IncrementalFormula(flat, values).Value(), expected, 1e-12);
+
+  std::stringstream out;
+  flat.Serialize(out);
+  auto data = out.str();
+  auto loaded = Formula::Deserialize(data.data(), data.size());
+  ASSERT_TRUE(loaded.has_value());
+  EXPECT_EQ(loaded->GetTree().GetRoot()->children_.size(), 15);
+  EXPECT_EQ(loaded->Evaluate(values), flat.Evaluate(values));
+
+  flat.Optimize();
+  EXPECT_EQ(flat.GetTree().GetRoot()->children_.size(), 14);
+  EXPECT_NEAR(flat.Evaluate(values), expected, 1e-12);
+
+  // The n-ary product rule, with an independent factor in the middle.
+  auto derivative = differentiator_.Differentiate("x*sin(x)*y*x^2", "x");
+  UnorderedMap<String, long double> point = {{"x", 0.5}, {"y", 3}};
+  EXPECT_NEAR(derivative.Evaluate(point),
+              Formula("y*(3*x^2*sin(x)+x^3*cos(x))").Evaluate(point), 1e-12);
+  EXPECT_EQ(differentiator_.Differentiate("x+y+x*z+z", "x").ToString(),
+            "1+z");
+}
+
+TEST_F(Tests, Test_27) {
+  // A left-deep chain of 10^5 operations: building, walking, copying and
+  // releasing it must not recurse once per level.
+  const size_t depth = 100000;
+  String expr = "x";
+  for (size_t i = 0; i < depth; ++i) {
+    expr += i % 2 == 0 ? "-y" : "+x";
+  }
+
+  Formula formula(expr);
+  EXPECT_EQ(formula.Size(), 2 * depth + 1);
+  EXPECT_EQ(formula.Evaluate({{"x", 3}, {"y", 2}}), 3 + depth / 2);
+  EXPECT_EQ(formula.At({{"y", "2"}}).Evaluate({{"x", 3}}), 3 + depth / 2);
+  EXPECT_EQ(formula.ToString().size(), expr.size());
+}
+
+TEST_F(Tests, Test_28) {
+  String expr = "x";
+  for (size_t i = 1; i < 1000; ++i) {
+    expr += i % 3 == 0 ? "+x*y*z" : "+y";
+  }
+  Formula chain(expr);
+  Formula balanced(expr);
+  balanced.Rebalance();
+  EXPECT_EQ(chain.Depth(), 1000);
+  EXPECT_EQ(balanced.Depth(), 13);
+  EXPECT_EQ(balanced.Size(), chain.Size());
+  EXPECT_EQ(balanced.ToString(), chain.ToString());
+  UnorderedMap<String, long double> point = {{"x", 0.5}, {"y", 2}, {"z", 3}};
+  EXPECT_EQ(balanced.Evaluate(point), chain.Evaluate(point));
+
+  // A large term hides the small ones from a running sum.
+  String terms = "x";
+  for (size_t i = 0; i < 10000; ++i) {
+    terms += "+y";
+  }
+  Formula sum(terms + "+z");
+  sum.Flatten();
+  UnorderedMap<String, long double> large = {
+      {"x", 1e22}, {"y", 1}, {"z", -1e22}};
+  EXPECT_NE(sum.Evaluate(large), 10000);
+  EXPECT_EQ(sum.Evaluate(large, Formula::Summation::kKahan), 10000);
+
+  // Pairwise sums lose less than running ones.
+  Formula small(terms);
+  small.Flatten();
+  UnorderedMap<String, long double> tenths = {{"x", 0.1}, {"y", 0.1}};
+  long double exact = small.Evaluate(tenths, Formula::Summation::kKahan);
+  EXPECT_LT(std::abs(small.Evaluate(tenths, Formula::Summation::kPairwise) -
+                     exact),
+            std::abs(Formula(terms).Evaluate(tenths) - exact));
+}
+
+TEST_F(Tests, Test_29) {
+  ForkJoinPool pool(4);
+  Vector<size_t> runs(1000);
+  pool.Run(runs.size(), [&](size_t task, size_t thread) {
+    EXPECT_LT(thread, pool.ThreadsNumber());
+    ++runs[task];
+  });
+  for (size_t run : runs) {
+    EXPECT_EQ(run, 1);
+  }
+
+  String expr = "x";
+  for (size_t i = 0; i < 300; ++i) {
+    expr += i % 2 == 0 ? "+x*y*(2+3)+sin(x)*0" : "+log(x*y)^(1+1)-x/y";
+  }
+  Differentiator sequential;
+  auto expected = sequential.Differentiate(expr, "x");
+  for (size_t threshold : {1, 16, 1000000}) {
+    Differentiator parallel(&pool, threshold);
+    EXPECT_EQ(parallel.Differentiate(expr, "x").ToString(),
+              expected.ToString());
+  }
+
+  // The small terms of the flattened sum are batched, not a task each.
+  Formula flat(expr);
+  flat.Flatten();
+  auto parts = flat.GetTree().Split(16);
+  Vector<size_t> tasks;
+  Vector<size_t> batches;
+  Parser::ParseTree::CollectTasks(parts, tasks, batches);
+  EXPECT_EQ(tasks.size(), 601);
+  EXPECT_LE(batches.size() - 1, flat.Size() / 16 + 1);
+  for (size_t batch = 0; batch + 1 < batches.size(); ++batch) {
+    size_t size = 0;
+    for (size_t task = batches[batch]; task < batches[batch + 1]; ++task) {
+      size += parts[tasks[task]].size_;
+    }
+    EXPECT_LT(size, 32);
+  }
+}
+
+TEST_F(Tests, Test_30) {
+  for (const auto &expr :
+       {"x", "y", "2*(x+1)-y/2", "x^(y^z)", "2^x", "x*y*z*x", "y-x",
+        "log(x^cos(x)*y^sin(x)) + (y+x) * (z - x / (z + x)) * x"}) {
+    Formula formula(expr);
+    formula.Flatten();
+    LazyDerivative lazy(formula, "x");
+    auto derivative = Differentiator().Differentiate(expr, "x");
+    // x^(y^z) overflows at the other points.
+    for (size_t i = 0; i < 2; ++i) {
+      UnorderedMap<String, long double> values;
+      for (const auto &[name, value] : variables_[i]) {
+        values.insert({name, std::stold(value)});
+      }
+      long double expected = derivative.Evaluate(values);
+      EXPECT_NEAR(lazy.Evaluate(values), expected,
+                  1e-9 * (1 + std::abs(expected)));
+      EXPECT_NEAR(Formula(lazy.ToString()).Evaluate(values), expected,
+                  1e-9 * (1 + std::abs(expected)));
+    }
+  }
+
+  // The top of a long sum does not expand the terms under it.
+  String expr = "x*y";
+  for (size_t i = 0; i < 1000; ++i) {
+    expr += "+sin(x)*y";
+  }
+  Formula sum(expr);
+  sum.Flatten();
+  LazyDerivative lazy(sum, "x");
+  EXPECT_TRUE(lazy.GetToken(LazyDerivative::kRoot).Type() ==
+              Parser::BaseTokenTypes::PLUS);
+  EXPECT_EQ(lazy.ChildrenNumber(LazyDerivative::kRoot), 1001);
+  size_t first = lazy.GetChild(LazyDerivative::kRoot, 0);
+  EXPECT_TRUE(lazy.GetToken(first).Type() == Parser::BaseTokenTypes::MULT);
+  EXPECT_LT(lazy.MaterializedNumber(), 10);
+}
+
+TEST_F(Tests, Test_31) {
+  EXPECT_EQ(sizeof(Parser::TokenRef), 4);
+
+  auto plus = Parser::GetOperator(Parser::BaseTokenTypes::PLUS);
+  ASSERT_TRUE(plus);
+  EXPECT_TRUE(plus->Type() == Parser::BaseTokenTypes::PLUS);
+  EXPECT_EQ(plus->ToString(), "+");
+  EXPECT_EQ(plus->Info().priority_, 1);
+  EXPECT_EQ(plus->Info().operands_number_, 2);
+  auto sin = Parser::GetOperator(Parser::BaseTokenTypes::SIN);
+  ASSERT_TRUE(sin);
+  EXPECT_TRUE(sin->Info().is_function_);
+  EXPECT_FALSE(Parser::GetOperator(Parser::BaseTokenTypes::NUMBER));
+  EXPECT_FALSE(Parser::GetOperator(Parser::BaseTokenTypes::LBRACE));
+
+  // Tokens outlive the parser that read them.
+  std::optional<Parser::ParseTree> tree;
+  {
+    Parser parser;
+    tree = parser.Parse("x*(25+sin(y))");
+  }
+  ASSERT_TRUE(tree);
+  auto root = tree->GetRoot();
+  EXPECT_TRUE(root->value_.Type() == Parser::BaseTokenTypes::MULT);
+  EXPECT_EQ(root->children_[0]->value_.GetName(), "x");
+  const auto &sum = root->children_[1];
+  EXPECT_TRUE(sum->value_.Type() == Parser::BaseTokenTypes::PLUS);
+  EXPECT_TRUE(sum->children_[0]->value_.Type() ==
+              Parser::BaseTokenTypes::NUMBER);
+  EXPECT_EQ(sum->children_[0]->value_.GetNumber().GetValue(), 25);
+
+  auto number = Parser::AddNumber(Number(7, 2));
+  EXPECT_TRUE(number.Type() == Parser::BaseTokenTypes::NUMBER);
+  EXPECT_EQ(number.GetNumber().GetValue(), 3.5L);
+  EXPECT_EQ(&Parser::AddNumber(Number(7, 2)).GetNumber(), &number.GetNumber());
+
+  // The numbers of a finished thread with no handles left are reused.
+  auto added = [] {
+    const Number *address = nullptr;
+    std::thread([&] {
+      address = &Parser::AddNumber(Number(0.1L)).GetNumber();
+    }).join();
+    return address;
+  };
+  EXPECT_EQ(added(), added());
+
+  Formula formula("x*(2+sin(y))^2-log(x)/3");
+  EXPECT_EQ(Formula(formula.ToString()).ToString(), formula.ToString());
+}
+
+TEST_F(Tests, Test_32) {
+  // A literal beyond int64 keeps its text and its value.
+  auto large = differentiator_.Differentiate("x*12345678901234567890", "x");
+  EXPECT_EQ(large.ToString(), "12345678901234567890");
+  EXPECT_EQ(Formula(large.ToString()).Evaluate({{"x", 1}}),
+            12345678901234567890.0L);
+
+  // Exact fractions print as fractions and survive a second derivative.
+  auto first = differentiator_.Differentiate("x^2*(1/3)", "x");
+  EXPECT_EQ(first.ToString(), "2*x*(1/3)");
+  auto second = differentiator_.Differentiate(first.ToString(), "x");
+  EXPECT_EQ(std::stold(second.ToString()), 2.0L / 3);
+
+  // Inexact values print with every digit and parse back.
+  auto folded = Formula("log(2)");
+  folded.Optimize();
+  EXPECT_EQ(Formula(folded.ToString()).Evaluate({{"x", 0}}),
+            std::log(2.0L));
+  auto third = differentiator_.Differentiate("x*" + folded.ToString(), "x");
+  EXPECT_EQ(third.Evaluate({{"x", 0}}), std::log(2.0L));
+
+  // Terminating fractions print once, as decimals.
+  EXPECT_EQ(Number(1, 2).ToString(), "0.5");
+  EXPECT_EQ(Number::Parse("2.5").ToString(), "2.5");
+  auto root = differentiator_.Differentiate("x^(1/2)", "x");
+  EXPECT_EQ(Formula(root.ToString()).Evaluate({{"x", 4}}), 0.25L);
+  auto power = differentiator_.Differentiate("x^2.5", "x");
+  power = differentiator_.Differentiate(power.ToString(), "x");
+  EXPECT_EQ(power.Evaluate({{"x", 4}}), 7.5L);
+
+  // Negatives, NaN and infinity print in forms the parser reads.
+  EXPECT_EQ(Number(-3, 1).ToString(), "(0-3)");
+  EXPECT_EQ(Number(-1, 2).ToString(), "(0-0.5)");
+  EXPECT_EQ(Number(std::nanl("")).ToString(), "(0/0)");
+  EXPECT_EQ(Number(-HUGE_VALL).ToString(), "(0-(1/0))");
+  auto negative = differentiator_.Differentiate("x^2*(0-3)", "x");
+  negative = differentiator_.Differentiate(negative.ToString(), "x");
+  EXPECT_EQ(negative.Evaluate({{"x", 1}}), -6.0L);
+  auto nan = differentiator_.Differentiate("x*log(0-1)", "x");
+  EXPECT_TRUE(std::isnan(nan.Evaluate({{"x", 1}})));
+
+  // Text that does not parse gives an empty formula.
+  EXPECT_TRUE(differentiator_.Differentiate("x*", "x").ToString().empty());
+}
+
+TEST_F(Tests, Test_33) {
+  // Saved files get the mode a plain open would give them, not 0600.
+  mode_t mask = umask(022);
+  String filename = "Test_33.formula";
+  ASSERT_TRUE(Formula("x*y").Save(filename));
+  struct stat file_stat;
+  ASSERT_EQ(stat(filename.c_str(), &file_stat), 0);
+  EXPECT_EQ(file_stat.st_mode & 0777, 0644);
+  std::remove(filename.c_str());
+  umask(mask);
+}
+
+TEST_F(Tests, Test_34) {
+  // Folded constants reparse inside the derivative text.
+  EXPECT_EQ(differentiator_.Differentiate("x^2.5", "x").Evaluate({{"x", 4}}),
+            20.0L);
+  EXPECT_EQ(differentiator_.Differentiate("0.5*x^2", "x").Evaluate({{"x", 3}}),
+            3.0L);
+  EXPECT_EQ(differentiator_.Differentiate("x*1.5", "x").Evaluate({{"x", 0}}),
+            1.5L);
+  EXPECT_EQ(
+      differentiator_.Differentiate("sin(0.5*x)", "x").Evaluate({{"x", 0}}),
+      0.5L);
+  auto large =
+      differentiator_.Differentiate("x*1000000000000000000000000000000", "x");
+  EXPECT_EQ(large.Evaluate({{"x", 0}}),
+            std::stold("1000000000000000000000000000000"));
+}